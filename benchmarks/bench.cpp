@@ -0,0 +1,458 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+// Benchmarks for logcerr. Every case reports its throughput or latency
+// together with the number of heap allocations and write(2) calls per
+// message, counted by replacing operator new and interposing write.
+//
+// usage: bench <case> [argument]
+//   throughput sync|async   messages per second at 1, 2, 4, ... threads
+//   latency                 p50, p99, and p999 caller latency
+//   filtered                cost of a call below output_level
+//   merged                  identical messages with and without merging
+//   multiline               messages spanning several lines
+//   sanitize                large multi-line messages per control_policy
+//   output devnull|pipe|file
+//   allocations             fails unless preallocated messages allocate nothing
+
+#include <logcerr/call_site.hpp>
+#include <logcerr/log.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+
+
+namespace {
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> write_calls{0};
+
+  [[nodiscard]] void* allocate(std::size_t size, std::size_t alignment) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+
+    void* ptr = alignment <= alignof(std::max_align_t)
+      ? std::malloc(std::max<std::size_t>(size, 1))
+      : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+
+    if (ptr == nullptr) {
+      throw std::bad_alloc{};
+    }
+    return ptr;
+  }
+}
+
+void* operator new(std::size_t size) {
+  return allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t /*size*/) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t /*alignment*/) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t /*size*/, std::align_val_t /*alignment*/) noexcept {
+  std::free(ptr);
+}
+
+extern "C" ssize_t write(int fd, const void* data, size_t size) {
+  write_calls.fetch_add(1, std::memory_order_relaxed);
+  return syscall(SYS_write, fd, data, size);
+}
+
+
+
+
+
+namespace {
+#if defined(STD_FORMAT)
+  constexpr std::string_view backend{"std"};
+#else
+  constexpr std::string_view backend{"fmt"};
+#endif
+
+  using bench_clock = std::chrono::steady_clock;
+
+
+
+  struct counters {
+    uint64_t allocations;
+    uint64_t writes;
+  };
+
+  [[nodiscard]] counters snapshot() {
+    return {allocations.load(), write_calls.load()};
+  }
+
+
+
+  struct measurement {
+    counters                  before{snapshot()};
+    bench_clock::time_point   start {bench_clock::now()};
+
+    void report(std::string_view name, std::string_view detail, size_t messages) const {
+      const auto elapsed = std::chrono::duration<double>(bench_clock::now() - start);
+      const auto after   = snapshot();
+      const auto count   = static_cast<double>(std::max<size_t>(messages, 1));
+
+      std::printf("%-4s %-12s %-20s %12.0f msg/s %9.1f ns/msg  allocs/msg %6.3f  "
+                  "writes/msg %6.3f\n",
+                  backend.data(), std::string{name}.c_str(), std::string{detail}.c_str(),
+                  count / elapsed.count(), elapsed.count() * 1e9 / count,
+                  static_cast<double>(after.allocations - before.allocations) / count,
+                  static_cast<double>(after.writes - before.writes) / count);
+      std::fflush(stdout);
+    }
+  };
+
+
+
+  void redirect_stderr(const char* path) {
+    //NOLINTNEXTLINE(*-vararg)
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || dup2(fd, STDERR_FILENO) < 0) {
+      std::perror(path);
+      std::exit(EXIT_FAILURE);
+    }
+    close(fd);
+  }
+
+
+
+  void run_threads(size_t count, const std::function<void(size_t)>& body) {
+    std::vector<std::jthread> threads;
+    threads.reserve(count);
+
+    for (size_t t = 0; t < count; ++t) {
+      threads.emplace_back(body, t);
+    }
+  }
+
+
+
+
+
+  void bench_throughput(bool async) {
+    static constexpr size_t per_thread{50000};
+
+    if (async) {
+      logcerr::asynchronous(true);
+    }
+
+    const size_t max_threads{std::max<size_t>(std::thread::hardware_concurrency(), 1)};
+
+    for (size_t threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+      measurement m;
+
+      run_threads(threads, [](size_t t) {
+        for (size_t i = 0; i < per_thread; ++i) {
+          logcerr::log("message {} from thread {}", i, t);
+        }
+      });
+      logcerr::flush();
+
+      m.report(async ? "async" : "sync", "threads=" + std::to_string(threads),
+               threads * per_thread);
+
+      if (threads == max_threads) {
+        break;
+      }
+    }
+  }
+
+
+
+  void report_percentiles(std::string_view detail, std::vector<bench_clock::duration>& samples) {
+    std::ranges::sort(samples);
+
+    auto percentile = [&](double p) {
+      const auto index = static_cast<size_t>(p * static_cast<double>(samples.size() - 1));
+      return std::chrono::duration<double, std::nano>(samples.at(index)).count();
+    };
+
+    std::printf("%-4s %-12s %-20s p50 %9.0f ns  p99 %9.0f ns  p999 %9.0f ns\n",
+                backend.data(), "latency", std::string{detail}.c_str(),
+                percentile(0.5), percentile(0.99), percentile(0.999));
+    std::fflush(stdout);
+  }
+
+  void bench_latency() {
+    static constexpr size_t per_thread{100000};
+
+    for (size_t threads: {1, 4}) {
+      std::vector<std::vector<bench_clock::duration>> samples(threads);
+      for (auto& s: samples) {
+        s.resize(per_thread);
+      }
+
+      measurement m;
+
+      run_threads(threads, [&](size_t t) {
+        auto& own = samples.at(t);
+        for (size_t i = 0; i < per_thread; ++i) {
+          const auto start = bench_clock::now();
+          logcerr::log("latency sample {} from thread {}", i, t);
+          own[i] = bench_clock::now() - start;
+        }
+      });
+
+      const auto detail = "threads=" + std::to_string(threads);
+      m.report("latency", detail, threads * per_thread);
+
+      std::vector<bench_clock::duration> all;
+      for (auto& s: samples) {
+        all.insert(all.end(), s.begin(), s.end());
+      }
+      report_percentiles(detail, all);
+    }
+  }
+
+
+
+  void bench_filtered() {
+    static constexpr size_t calls{20000000};
+
+    logcerr::output_level(logcerr::severity::warning);
+
+    {
+      measurement m;
+      for (size_t i = 0; i < calls; ++i) {
+        logcerr::log("filtered {}", i);
+      }
+      m.report("filtered", "function", calls);
+    }
+
+    {
+      measurement m;
+      for (size_t i = 0; i < calls; ++i) {
+        LOGCERR_LOG("filtered {}", i);
+      }
+      m.report("filtered", "call site", calls);
+    }
+
+    {
+      const std::string state(256, 'x');
+
+      measurement m;
+      for (size_t i = 0; i < calls; ++i) {
+        logcerr::log("filtered {}", logcerr::lazy([&]() { return state + std::to_string(i); }));
+      }
+      m.report("filtered", "lazy", calls);
+    }
+  }
+
+
+
+  void bench_merged() {
+    static constexpr size_t messages{200000};
+
+    for (size_t merge: {size_t{2}, logcerr::disable_merging}) {
+      logcerr::merge_after(merge);
+
+      measurement m;
+      for (size_t i = 0; i < messages; ++i) {
+        logcerr::log("this message is always the same");
+      }
+      logcerr::interrupt_merging();
+
+      m.report("merged", merge == logcerr::disable_merging ? "disabled" : "after=2",
+               messages);
+    }
+  }
+
+
+
+  [[nodiscard]] bool bench_allocations() {
+    static constexpr size_t warmup  {4 * logcerr::default_queue_capacity};
+    static constexpr size_t messages{200000};
+
+    logcerr::preallocate(256);
+
+    bool success{true};
+
+    for (std::string_view mode: {"merged", "unmerged", "async"}) {
+      logcerr::merge_after(mode == "unmerged" ? logcerr::disable_merging : 2);
+      logcerr::asynchronous(mode == "async");
+
+      auto body = [mode](size_t i) {
+        logcerr::log("message {} written {} with value {:.3f}", i, mode,
+                     static_cast<double>(i) / 2);
+        logcerr::warn("a message without arguments");
+      };
+
+      // fills the buffers of this thread, the entry, and every queue slot
+      for (size_t i = 0; i < warmup; ++i) {
+        body(i);
+      }
+      logcerr::flush();
+
+      measurement m;
+      for (size_t i = 0; i < messages; ++i) {
+        body(i);
+      }
+      logcerr::flush();
+      m.report("allocations", mode, 2 * messages);
+
+      if (const auto count = snapshot().allocations - m.before.allocations; count > 0) {
+        std::printf("%s: %llu allocations\n", std::string{mode}.c_str(),
+                    static_cast<unsigned long long>(count));
+        success = false;
+      }
+    }
+
+    logcerr::asynchronous(false);
+
+    return success;
+  }
+
+
+
+  void bench_multiline() {
+    static constexpr size_t messages{100000};
+
+    for (size_t lines: {1, 4, 16}) {
+      std::string text;
+      for (size_t l = 0; l < lines; ++l) {
+        text += "this is line " + std::to_string(l) + " of a longer message\n";
+      }
+
+      measurement m;
+      for (size_t i = 0; i < messages; ++i) {
+        logcerr::log("{}{}", i, text);
+      }
+
+      m.report("multiline", "lines=" + std::to_string(lines), messages);
+    }
+  }
+
+
+
+  void bench_sanitize() {
+    static constexpr size_t messages{20000};
+    static constexpr size_t lines   {256};
+
+    std::string payload;
+    for (size_t l = 0; l < lines; ++l) {
+      payload += "line " + std::to_string(l) + " of a large payload, mostly plain text";
+      if (l % 16 == 0) {
+        payload += " with \x1b[31mcolor\x1b[0m and a\rcarriage return";
+      }
+      payload += '\n';
+    }
+
+    // identical messages would be merged without being split again
+    logcerr::merge_after(logcerr::disable_merging);
+
+    for (auto [policy, name]: {std::pair{logcerr::control_policy::keep,   "keep"},
+                               std::pair{logcerr::control_policy::escape, "escape"},
+                               std::pair{logcerr::control_policy::strip,  "strip"}}) {
+      logcerr::sanitize(policy);
+
+      measurement m;
+      for (size_t i = 0; i < messages; ++i) {
+        logcerr::log(payload);
+      }
+      m.report("sanitize", name, messages);
+    }
+
+    logcerr::sanitize(logcerr::control_policy::keep);
+  }
+
+
+
+  void bench_output(std::string_view target) {
+    static constexpr size_t messages{200000};
+
+    std::jthread reader;
+
+    if (target == "pipe") {
+      std::array<int, 2> fds{};
+      if (pipe(fds.data()) != 0 || dup2(fds[1], STDERR_FILENO) < 0) {
+        std::perror("pipe");
+        std::exit(EXIT_FAILURE);
+      }
+      close(fds[1]);
+
+      reader = std::jthread{[fd = fds[0]]() {
+        std::array<char, 65536> buffer{};
+        while (read(fd, buffer.data(), buffer.size()) > 0) {}
+        close(fd);
+      }};
+    } else if (target == "file") {
+      redirect_stderr("logcerr-bench.log");
+    } else if (target != "devnull") {
+      std::fprintf(stderr, "unknown output %s\n", std::string{target}.c_str());
+      std::exit(EXIT_FAILURE);
+    }
+
+    {
+      measurement m;
+      for (size_t i = 0; i < messages; ++i) {
+        logcerr::log("message {} written to {}", i, target);
+      }
+      logcerr::flush();
+      m.report("output", target, messages);
+    }
+
+    if (target == "pipe") {
+      // closes the write end, which stops the reader
+      redirect_stderr("/dev/null");
+    } else if (target == "file") {
+      unlink("logcerr-bench.log");
+    }
+  }
+}
+
+
+
+
+
+int main(int argc, char** argv) {
+  const std::vector<std::string_view> args(argv + 1, argv + argc);
+
+  if (args.empty()) {
+    std::fprintf(stderr, "usage: %s <case> [argument]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  redirect_stderr("/dev/null");
+
+  const auto argument = args.size() > 1 ? args[1] : std::string_view{};
+
+  if (args[0] == "throughput") {
+    bench_throughput(argument == "async");
+  } else if (args[0] == "latency") {
+    bench_latency();
+  } else if (args[0] == "filtered") {
+    bench_filtered();
+  } else if (args[0] == "merged") {
+    bench_merged();
+  } else if (args[0] == "multiline") {
+    bench_multiline();
+  } else if (args[0] == "sanitize") {
+    bench_sanitize();
+  } else if (args[0] == "output") {
+    bench_output(argument.empty() ? "devnull" : argument);
+  } else if (args[0] == "allocations") {
+    return bench_allocations() ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else {
+    std::fprintf(stdout, "unknown case %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+}
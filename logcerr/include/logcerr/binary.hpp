@@ -0,0 +1,97 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#ifndef LOGCERR_BINARY_HPP_INCLUDED
+#define LOGCERR_BINARY_HPP_INCLUDED
+
+#include "logcerr/log.hpp"
+
+#include <chrono>
+#include <deque>
+#include <istream>
+#include <string>
+#include <string_view>
+
+
+
+namespace logcerr {
+
+/// An entry read from output written with output_encoding::binary.
+/// All views refer to the binary_reader which has read the entry and remain
+/// valid until it reads the next entry.
+struct binary_entry {
+  severity                  level{severity::log};
+  /// Time since start of the log.
+  std::chrono::microseconds time{};
+  std::string_view          thread_name;
+  /// Name of the category which created the entry, empty if none.
+  std::string_view          category;
+  std::string_view          format;
+  /// Encoded arguments of format, see format_message.
+  std::string_view          arguments;
+  /// Fields attached with kv, serialized by impl::field_list.
+  std::string_view          fields;
+};
+
+
+
+/// Reads entries written with output_encoding::binary from a stream.
+/// Reading an entry only decodes its metadata; the message is formatted on
+/// request by format_message or format_text, so that entries can be filtered
+/// without formatting them.
+class binary_reader {
+  public:
+    /// Reads the header from input, which must remain valid for the lifetime
+    /// of the reader.
+    ///
+    /// @throws std::runtime_error if input does not start with a valid header
+    explicit binary_reader(std::istream& input);
+
+    /// Reads the next entry into entry. Returns false once the end of input is
+    /// reached. Further headers, written when output has been appended to an
+    /// existing log, are accepted and update start.
+    ///
+    /// @throws std::runtime_error if a record is incomplete, e.g. after a
+    ///   crash, or refers to an unknown string
+    [[nodiscard]] bool next(binary_entry& entry);
+
+    /// Obtains the wall-clock time at which the log, or the part of it the last
+    /// entry belongs to, has been started.
+    [[nodiscard]] std::chrono::system_clock::time_point start() const noexcept {
+      return origin;
+    }
+
+
+
+  private:
+    std::istream*                         input;
+    std::chrono::system_clock::time_point origin;
+
+    // never relocates its elements, so that views into them remain valid
+    std::deque<std::string> strings;
+    std::string             record;
+
+    [[nodiscard]] bool read_header();
+    [[nodiscard]] bool read_record(char& kind);
+};
+
+
+
+/// Formats the message of entry. Arguments which cannot be formatted with
+/// their replacement field, e.g. since it refers to another argument for its
+/// width, are shown after the format string.
+[[nodiscard]] std::string format_message(const binary_entry& entry);
+
+/// Formats entry in the layout used for stderr, including the terminating line
+/// break. start is the wall-clock time of the start of the log, see
+/// binary_reader::start.
+[[nodiscard]] std::string format_text(
+    const binary_entry&                   entry,
+    std::chrono::system_clock::time_point start,
+    time_format                           fmt = time_format::elapsed,
+    bool                                  colored = false
+);
+
+}
+
+#endif // LOGCERR_BINARY_HPP_INCLUDED
@@ -0,0 +1,188 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#ifndef LOGCERR_CALL_SITE_HPP_INCLUDED
+#define LOGCERR_CALL_SITE_HPP_INCLUDED
+
+#include "logcerr/log.hpp"
+
+#include <atomic>
+#include <functional>
+#include <string_view>
+
+
+
+namespace logcerr {
+
+class call_site;
+
+namespace impl {
+  struct call_site_registry;
+  class  limiter;
+
+  [[nodiscard]] bool admit(const call_site& site, limiter& lim) noexcept;
+}
+
+
+
+/// An enum describing if a call_site is printed independently of output_level.
+enum class site_state {
+  inherit,
+  enabled,
+  disabled,
+};
+
+
+
+
+
+/// Limits how many entries a call site creates.
+struct rate_limit {
+  /// Average number of entries admitted per second; 0 disables rate limiting.
+  double per_second{0};
+  /// Number of entries which may be admitted at once after a quiet period.
+  size_t burst{1};
+  /// Only every sample-th entry is considered, the others are dropped without
+  /// being reported; 0 and 1 disable sampling.
+  size_t sample{1};
+};
+
+
+
+
+
+/// Static description of a single location which creates log entries.
+/// Call sites are created by the LOGCERR_* macros and register themselves in a
+/// global registry on first use.
+class call_site {
+  public:
+    call_site(const call_site&) = delete;
+    call_site(call_site&&)      = delete;
+    call_site& operator=(const call_site&) = delete;
+    call_site& operator=(call_site&&)      = delete;
+
+    ~call_site() = default;
+
+    call_site(severity level, std::string_view format, std::string_view file,
+              unsigned int line);
+
+
+
+    /// Checks if entries created at this call site will be printed.
+    [[nodiscard]] bool enabled() const noexcept {
+      return active.load(std::memory_order_relaxed);
+    }
+
+    /// Overrides output_level for this call site.
+    void state(site_state value);
+
+    [[nodiscard]] site_state state() const noexcept { return mode.load(); }
+
+
+
+    /// Checks if an entry may be created according to the rate_limit of this
+    /// call site. Must only be called if enabled() returned true.
+    /// If entries have been suppressed by the rate limit, a line reporting
+    /// their number is created before returning true. Entries skipped by
+    /// sampling are expected and not reported.
+    [[nodiscard]] bool admit() const noexcept {
+      auto* lim = rate.load(std::memory_order_relaxed);
+      return lim == nullptr || impl::admit(*this, *lim);
+    }
+
+    /// Sets the rate_limit of this call site. A default constructed rate_limit
+    /// removes any limit.
+    void limit(const rate_limit& value);
+
+
+
+    [[nodiscard]] severity         level()  const noexcept { return lvl;         }
+    [[nodiscard]] std::string_view format() const noexcept { return fmt;         }
+    [[nodiscard]] std::string_view file()   const noexcept { return file_name;   }
+    [[nodiscard]] unsigned int     line()   const noexcept { return line_number; }
+
+
+
+  private:
+    severity         lvl;
+    std::string_view fmt;
+    std::string_view file_name;
+    unsigned int     line_number;
+
+    std::atomic<bool>           active{false};
+    std::atomic<site_state>     mode  {site_state::inherit};
+    std::atomic<impl::limiter*> rate  {nullptr};
+
+    // reconfigured whenever this call site is limited individually, guarded
+    // by the registry
+    impl::limiter* own_rate{nullptr};
+
+    call_site* next{nullptr};
+
+    friend struct impl::call_site_registry;
+};
+
+
+
+/// Sets the state of all call sites whose location "file:line" matches pattern,
+/// including call sites which are registered later. In pattern, '*' matches any
+/// sequence of characters and '?' any single character.
+/// Later calls take precedence over earlier ones.
+void call_site_state(std::string_view pattern, site_state state);
+
+/// Sets a rate_limit for every call site whose location "file:line" matches
+/// pattern, including call sites which are registered later. Each call site is
+/// limited individually. A later call with the same pattern replaces the limit.
+void call_site_limit(std::string_view pattern, const rate_limit& limit);
+
+/// Sets a rate_limit for all call sites whose format string matches pattern,
+/// including call sites which are registered later. All matching call sites
+/// share a single limit. A later call with the same pattern replaces the limit.
+void format_limit(std::string_view pattern, const rate_limit& limit);
+
+/// Removes all rules set by call_site_state, call_site_limit, and format_limit,
+/// resets all call sites to site_state::inherit, and removes their limits.
+void reset_call_sites();
+
+/// Invokes callback for every registered call site.
+void for_each_call_site(const std::function<void(call_site&)>& callback);
+
+}
+
+
+
+
+
+/// Creates a log entry of severity level through a static call_site.
+/// Arguments are only evaluated if the call site is enabled and admitted by its
+/// rate_limit, or if the flight recorder is active.
+#define LOGCERR_PRINT(logcerr_level_, logcerr_fmt_, ...)                           \
+  do {                                                                             \
+    static ::logcerr::call_site logcerr_site_{                                     \
+      (logcerr_level_), (logcerr_fmt_), __FILE__, __LINE__};                       \
+    if (logcerr_site_.enabled()) {                                                 \
+      if (logcerr_site_.admit()) {                                                 \
+        ::logcerr::impl::print_unchecked(logcerr_site_.level(),                    \
+                                         (logcerr_fmt_) __VA_OPT__(,) __VA_ARGS__);\
+      }                                                                            \
+    } else if (::logcerr::impl::filtered_out(logcerr_site_.level())) {             \
+      ::logcerr::impl::record_unchecked(logcerr_site_.level(),                     \
+                                        (logcerr_fmt_) __VA_OPT__(,) __VA_ARGS__); \
+    }                                                                              \
+  } while (false)
+
+/// Same as LOGCERR_PRINT(severity::debug, ...) if debugging_enabled() evaluates
+/// to true, otherwise a no-op.
+#define LOGCERR_DEBUG(...)                                                         \
+  do {                                                                             \
+    if constexpr (::logcerr::debugging_enabled()) {                                \
+      LOGCERR_PRINT(::logcerr::severity::debug, __VA_ARGS__);                      \
+    }                                                                              \
+  } while (false)
+
+#define LOGCERR_VERBOSE(...) LOGCERR_PRINT(::logcerr::severity::verbose, __VA_ARGS__)
+#define LOGCERR_LOG(...)     LOGCERR_PRINT(::logcerr::severity::log,     __VA_ARGS__)
+#define LOGCERR_WARN(...)    LOGCERR_PRINT(::logcerr::severity::warning, __VA_ARGS__)
+#define LOGCERR_ERROR(...)   LOGCERR_PRINT(::logcerr::severity::error,   __VA_ARGS__)
+
+#endif // LOGCERR_CALL_SITE_HPP_INCLUDED
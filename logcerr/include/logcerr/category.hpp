@@ -0,0 +1,128 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#ifndef LOGCERR_CATEGORY_HPP_INCLUDED
+#define LOGCERR_CATEGORY_HPP_INCLUDED
+
+#include "logcerr/log.hpp"
+
+#include <atomic>
+#include <string_view>
+
+
+
+namespace logcerr {
+
+namespace impl {
+  struct category_registry;
+}
+
+
+
+/// A named source of log entries, e.g. a subsystem like "net" or "storage",
+/// with an output_level independent of the global one. The name is shown in
+/// front of the message and is written as "category" by structured encodings.
+///
+/// Categories without a matching category_level rule follow output_level.
+/// Several category objects may share the same name, in which case they share
+/// all rules.
+class category {
+  public:
+    category(const category&) = delete;
+    category(category&&)      = delete;
+    category& operator=(const category&) = delete;
+    category& operator=(category&&)      = delete;
+
+    explicit category(std::string_view name);
+
+    ~category();
+
+
+
+    [[nodiscard]] std::string_view name() const noexcept { return label; }
+
+    /// Checks if a message of severity level created through this category
+    /// will be printed with the current settings.
+    [[nodiscard]] bool is_outputted(severity level) const noexcept {
+      return level >= threshold.load(std::memory_order_relaxed);
+    }
+
+    /// Returns what severity a message of this category needs to be printed.
+    [[nodiscard]] severity output_level() const noexcept {
+      return threshold.load(std::memory_order_relaxed);
+    }
+
+
+
+    /// Same as logcerr::print, but filtered by the output_level of this
+    /// category and shown with its name.
+    template<typename... Args>
+    void print(severity level, format_string<Args...> fmt, Args&&... args) const {
+      if (is_outputted(level)) {
+        impl::print_unchecked(label, level, std::move(fmt), std::forward<Args>(args)...);
+      } else if (impl::filtered_out(level)) {
+        impl::record_unchecked(level, std::move(fmt), std::forward<Args>(args)...);
+      }
+    }
+
+
+
+    /// Forwards to print(severity::debug, fmt, args) if debugging_enabled()
+    /// evaluates to true, otherwise a no-op.
+    template<typename... Args>
+    void debug(format_string<Args...> fmt, Args&&... args) const {
+      if constexpr (debugging_enabled()) {
+        print(severity::debug, std::move(fmt), std::forward<Args>(args)...);
+      }
+    }
+
+    template<typename... Args>
+    void verbose(format_string<Args...> fmt, Args&&... args) const {
+      print(severity::verbose, std::move(fmt), std::forward<Args>(args)...);
+    }
+
+    template<typename... Args>
+    void log(format_string<Args...> fmt, Args&&... args) const {
+      print(severity::log, std::move(fmt), std::forward<Args>(args)...);
+    }
+
+    template<typename... Args>
+    void warn(format_string<Args...> fmt, Args&&... args) const {
+      print(severity::warning, std::move(fmt), std::forward<Args>(args)...);
+    }
+
+    template<typename... Args>
+    void error(format_string<Args...> fmt, Args&&... args) const {
+      print(severity::error, std::move(fmt), std::forward<Args>(args)...);
+    }
+
+
+
+  private:
+    std::string_view      label;
+    std::atomic<severity> threshold{severity::log};
+
+    // guarded by the registry mutex
+    bool      overridden{false};
+    category* previous  {nullptr};
+    category* next      {nullptr};
+
+    friend struct impl::category_registry;
+};
+
+
+
+/// Sets the output_level of all categories whose name matches pattern,
+/// including categories which are created later. In pattern, '*' matches any
+/// sequence of characters and '?' any single character, e.g. "net.*" selects
+/// all categories with the prefix "net.".
+/// Later calls take precedence over earlier ones.
+void category_level(std::string_view pattern, severity lowest_level);
+
+/// Removes all rules set by category_level, such that all categories follow
+/// output_level again.
+void reset_category_levels();
+
+}
+
+#endif // LOGCERR_CATEGORY_HPP_INCLUDED
@@ -0,0 +1,79 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#ifndef LOGCERR_FLIGHT_RECORDER_HPP_INCLUDED
+#define LOGCERR_FLIGHT_RECORDER_HPP_INCLUDED
+
+#include "logcerr/log.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+
+
+namespace logcerr {
+
+/// Describes the size of the ring file used by the flight recorder.
+struct recorder_options {
+  /// Number of entries kept in the ring.
+  size_t slots{1024};
+  /// Bytes per entry, including 24 bytes of metadata. Longer thread names and
+  /// messages are truncated. Rounded up to a multiple of 8.
+  size_t slot_size{256};
+};
+
+/// Starts recording every entry, including entries below output_level, into a
+/// ring file at path which is mapped into memory. Since the mapping is shared
+/// with the file, recorded entries survive a crash of the process and can be
+/// read with read_flight_recorder. The file is created or truncated.
+/// Recording an entry takes a single atomic increment and no lock.
+///
+/// @throws std::system_error if the file cannot be created or mapped
+/// @throws std::invalid_argument if options describe an empty ring
+void flight_recorder(const std::filesystem::path& path,
+                     const recorder_options& options = {});
+
+/// Checks if the flight recorder is active.
+[[nodiscard]] bool flight_recorder() noexcept;
+
+/// Stops recording. The file keeps the recorded entries.
+void stop_flight_recorder() noexcept;
+
+/// Writes all entries of the active flight recorder in chronological order to
+/// fd. Only uses async-signal-safe functions, so it may be called from a
+/// signal handler or a std::terminate handler. Entries overwritten while being
+/// dumped are skipped. Returns without writing if another dump is in progress.
+void dump_flight_recorder(int fd = STDERR_FILENO) noexcept;
+
+/// Installs a std::terminate handler and handlers for SIGSEGV, SIGBUS, SIGFPE,
+/// SIGILL, and SIGABRT which call dump_flight_recorder(fd) before continuing
+/// with the previous behavior. The previous signal handlers, e.g. of a crash
+/// reporter, are restored and receive the signal afterwards.
+void dump_flight_recorder_on_crash(int fd = STDERR_FILENO);
+
+
+
+/// An entry read from a flight recorder file.
+struct recorded_entry {
+  uint64_t                  sequence;
+  std::chrono::microseconds time;
+  severity                  level;
+  std::string               thread_name;
+  std::string               message;
+};
+
+/// Decodes the entries of a flight recorder file in chronological order.
+/// Entries which were being written when the process stopped are skipped.
+///
+/// @throws std::runtime_error if the file is not a flight recorder file
+[[nodiscard]] std::vector<recorded_entry> read_flight_recorder(
+    const std::filesystem::path& path);
+
+}
+
+#endif // LOGCERR_FLIGHT_RECORDER_HPP_INCLUDED
@@ -4,17 +4,33 @@
 #ifndef LOGCERR_LOG_HPP_INCLUDED
 #define LOGCERR_LOG_HPP_INCLUDED
 
+#include <array>
+#include <atomic>
+#include <bit>
 #include <chrono>
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
 #include <mutex>
 #include <ostream>
+#include <string>
 #include <string_view>
 #include <thread>
+#include <tuple>
+#include <type_traits>
 
 
 
 #include <version>
 
-#if defined(__cpp_lib_format) || (_LIBCPP_VERSION >= 170001 && _LIBCPP_STD_VER >= 20)
+// Define LOGCERR_USE_FMT to use fmt even if std::format is available. It has to
+// be defined consistently for the library and everything including it.
+#if !defined(LOGCERR_USE_FMT) && \
+    (defined(__cpp_lib_format) || (_LIBCPP_VERSION >= 170001 && _LIBCPP_STD_VER >= 20))
 #define STD_FORMAT
 #endif
 
@@ -23,7 +39,8 @@
 #if defined(STD_FORMAT)
 #include <format>
 #else
-#include <fmt/core.h>
+// format.h defines the formatters of built-in types, which lazy_value derives from
+#include <fmt/format.h>
 #endif
 
 
@@ -123,9 +140,26 @@ void merge_after(size_t merge) noexcept;
 [[nodiscard]] size_t merge_after() noexcept;
 
 /// Interrupts the current chain of messages being merged by treating
-/// the next message as being different from the previous own.
+/// the next message as being different from the previous own. Occurrences
+/// withheld by the merge window are reported.
 void interrupt_merging();
 
+/// Sets the number of distinct recent entries which take part in merging.
+/// With a window of 1, the default, only successive identical entries are
+/// merged. With a larger window, an entry equal to one of the last entries
+/// distinct entries, but not to the previous one, is withheld once as many
+/// equal entries as given to merge_after have been printed. Withheld entries
+/// are reported as a single line with a counter when their entry falls out of
+/// the window or merging is interrupted. This merges e.g. several threads
+/// repeating their own messages in alternation. Changing the window reports
+/// withheld entries.
+///
+/// @throws std::invalid_argument if entries is 0
+void merge_window(size_t entries);
+
+/// Obtains the number of distinct entries which take part in merging.
+[[nodiscard]] size_t merge_window();
+
 
 
 
@@ -135,10 +169,68 @@ void interrupt_merging();
 
 
 
+/// An enum describing how the time of an entry is shown.
+enum class time_format {
+  /// HH:MM:SS.mmm since start
+  elapsed,
+  /// HH:MM:SS.uuuuuu since start
+  elapsed_micro,
+  /// YYYY-MM-DDTHH:MM:SS.mmmZ
+  utc,
+  /// YYYY-MM-DDTHH:MM:SS.uuuuuuZ
+  utc_micro,
+};
+
+/// Sets how the time of an entry is shown.
+/// The time is always taken once per entry when it is created. Wall-clock time
+/// is derived from the same monotonic clock using an offset which is refreshed
+/// every few seconds, so it does not cost an additional clock read per entry.
+///
+/// @throws std::invalid_argument if format is not a named value of time_format
+void timestamp_format(time_format format);
+
+/// Obtains the current time_format.
+[[nodiscard]] time_format timestamp_format() noexcept;
+
+
+
+
+
+/// An enum describing how control characters in messages are written by text
+/// output. Line breaks and tabs are always kept.
+enum class control_policy {
+  /// Write messages verbatim.
+  keep,
+  /// Replace carriage returns by \r and other control characters by \xHH, so
+  /// that escape sequences are shown as text.
+  escape,
+  /// Remove control characters together with the ANSI escape sequences they
+  /// start.
+  strip,
+};
+
+/// Sets how control characters in messages are written. Messages which
+/// contain carriage returns or escape sequences can otherwise overwrite
+/// previous output, change colors, or pretend to be separate entries. Entries
+/// passed to custom sinks (see entry_info) and structured encodings always
+/// carry the unmodified message.
+///
+/// @throws std::invalid_argument if policy is not a named value of
+///   control_policy
+void sanitize(control_policy policy);
+
+/// Obtains the current control_policy.
+[[nodiscard]] control_policy sanitize() noexcept;
+
+
+
 
 
 /// Associates a thread_id with a human-readable name.
 /// If a thread already had a name, it will be overwritten.
+/// Since thread ids are reused, a name given to a thread which has not written
+/// a log entry yet is discarded once a thread with that id writes its first
+/// entry; name other threads only after they have started logging.
 void thread_name(std::string_view name,
                  std::thread::id thread_id = std::this_thread::get_id());
 
@@ -165,10 +257,281 @@ void print_raw_sync(std::ostream& out, std::string_view message);
 
 
 
+/// Default number of entries which can be pending in asynchronous mode.
+static constexpr size_t default_queue_capacity{1024};
+
+/// Enables or disables asynchronous output.
+/// In asynchronous mode, entries are handed to a background thread through a
+/// bounded lock-free queue which holds at least capacity entries. If the queue
+/// is full, the calling thread waits until space becomes available. Entries
+/// created by formatters or sinks running on the background thread bypass the
+/// queue and are written right after the current entry.
+/// Changing the mode waits until all pending entries have been written.
+///
+/// @throws std::invalid_argument if capacity is 0
+void asynchronous(bool enable, size_t capacity = default_queue_capacity);
+
+/// Checks if asynchronous output is enabled.
+[[nodiscard]] bool asynchronous() noexcept;
+
+/// Blocks until all entries created prior to calling this function have been
+/// written to stderr. output_lock and print_raw_sync flush implicitly.
+void flush();
+
+
+
+
+
+/// Describes when buffered output is written to stderr.
+struct buffer_policy {
+  /// Write the buffer once it holds at least size bytes.
+  /// A size of 0 disables buffering.
+  size_t                    size{0};
+  /// Write the buffer once its oldest entry is older than interval.
+  /// An interval of 0 disables time based flushing.
+  std::chrono::milliseconds interval{0};
+  /// Write the buffer immediately after an entry of at least this severity.
+  severity                  immediate{severity::warning};
+};
+
+/// Sets the buffer_policy used for writing to stderr. Entries are written to
+/// STDERR_FILENO directly from a user-space buffer without going through
+/// std::cerr. Pending output is written before the policy changes.
+void buffering(const buffer_policy& policy);
+
+/// Obtains the current buffer_policy.
+[[nodiscard]] buffer_policy buffering();
+
+
+
+/// An enum describing what happens to an entry which does not fit into the
+/// backlog of a non-blocking output.
+enum class overload_policy {
+  /// Wait until the output accepts enough data.
+  block,
+  /// Discard the new entry.
+  drop_newest,
+  /// Discard pending entries of lower severity than the new one, lowest
+  /// severity and oldest first. If that does not free enough space, the new
+  /// entry is discarded.
+  drop_lowest,
+  /// Discard new entries below severity::error. Errors replace pending entries
+  /// of lower severity like with drop_lowest.
+  errors_only,
+};
+
+/// Describes how output is kept while stderr does not accept data.
+struct backlog_policy {
+  /// Maximum number of bytes waiting to be written. A capacity of 0 disables
+  /// non-blocking output.
+  size_t                    capacity{0};
+  overload_policy           overload{overload_policy::drop_lowest};
+  /// Maximum time to wait for the backlog to be written once non-blocking
+  /// output is disabled or the program exits. Entries still pending afterwards
+  /// are discarded and reported as dropped.
+  std::chrono::milliseconds drain_timeout{1000};
+};
+
+/// Sets the backlog_policy used for writing to stderr. With a capacity above 0,
+/// STDERR_FILENO is put into non-blocking mode and output which cannot be
+/// written immediately is kept in a backlog of at most capacity bytes. Entries
+/// only remain in the backlog for as long as the reader is stalled; a
+/// background thread writes them once stderr accepts data again, followed by a
+/// line reporting the number of discarded entries per severity.
+///
+/// Note that O_NONBLOCK applies to the open file description, which may be
+/// shared with other processes. It is removed again once the capacity is set
+/// to 0 or the program exits, which also writes the remaining backlog within
+/// drain_timeout.
+///
+/// @throws std::invalid_argument if overload is not a named value of
+///   overload_policy
+/// @throws std::system_error if the mode of stderr cannot be changed
+void nonblocking(const backlog_policy& policy);
+
+/// Obtains the current backlog_policy.
+[[nodiscard]] backlog_policy nonblocking();
+
+
+
+/// Describes how output is submitted through io_uring.
+struct uring_policy {
+  /// Number of buffers registered with the kernel. Entries are copied into the
+  /// current buffer and submitted without waiting for the write to complete.
+  /// A count of 0 disables io_uring.
+  size_t count{0};
+  /// Size of every buffer in bytes.
+  size_t size{size_t{64} << 10U};
+};
+
+/// Sets the uring_policy used for writing to stderr. With a count above 0,
+/// writes are submitted to an io_uring instance on Linux and their completions
+/// are reaped in batches, so that no thread waits for a write unless all
+/// buffers are in use. Buffers are written in order; output collected while a
+/// write is in progress is submitted together once it has completed. flush,
+/// output_lock, and print_raw_sync wait until all submitted writes have
+/// completed. Pending output is written before the policy changes.
+///
+/// If io_uring is unavailable, e.g. due to the kernel version or a seccomp
+/// filter, plain writes are used, and uring returns a count of 0. io_uring is
+/// not used while non-blocking output is enabled.
+///
+/// @throws std::invalid_argument if count is above 0 and size is 0
+void uring(const uring_policy& policy);
+
+/// Obtains the uring_policy in effect.
+[[nodiscard]] uring_policy uring();
+
+
+
+
+
+/// Enables or disables deferred formatting.
+/// With deferred formatting, entries created in asynchronous mode store the
+/// format string and a binary copy of their arguments, which are formatted on
+/// the background writer thread instead of the calling thread. Format strings
+/// must have static storage duration, which holds for string literals.
+///
+/// Strings are copied, types for which capture_by_value is true are copied
+/// bitwise. Entries with any other argument type, or with more than
+/// impl::deferred_message::capacity bytes of arguments, are formatted
+/// immediately.
+void defer_formatting(bool enable) noexcept;
+
+/// Checks if deferred formatting is enabled.
+[[nodiscard]] bool defer_formatting() noexcept;
+
+/// Controls if arguments of type T may be copied bitwise for deferred
+/// formatting. Holds for arithmetic and enumeration types by default; other
+/// types may refer to data that changes or is destroyed before the entry is
+/// written, e.g. views like std::span. Specialize as true for trivially
+/// copyable types which hold all data they format.
+template<typename T>
+inline constexpr bool capture_by_value = std::is_arithmetic_v<T> || std::is_enum_v<T>;
+
+
+
+
+
+/// Enables or disables preallocated message buffers.
+/// With a size above 0, every thread formats its messages into a buffer of at
+/// least size bytes. Instead of being freed, the buffer of a written entry is
+/// handed back to the thread which created the next one, so that entries with
+/// messages of at most size bytes are created and written to stderr without
+/// allocating once every thread and queue slot holds such a buffer. Longer
+/// messages and structured fields allocate as usual, and buffers grown to
+/// more than twice size are released again. Entries created while the
+/// arguments of another entry are formatted use a temporary buffer.
+void preallocate(size_t size);
+
+/// Obtains the size of preallocated message buffers, or 0 if disabled.
+[[nodiscard]] size_t preallocate() noexcept;
+
+
+
+
+
+/// A named value attached to an entry as structured field, see kv.
+template<typename T>
+struct key_value {
+  std::string_view key;
+  const T&         value;
+};
+
+/// Attaches value to an entry as field named key. Fields are passed as
+/// additional arguments to any logging function, e.g.
+///   logcerr::log("request done", kv("ms", 12), kv("path", path));
+/// They are not consumed by the format string, but are shown as key=value if
+/// referenced. Text output appends all fields in logfmt style, structured
+/// encodings (see sink_options) write them next to time, thread, level, and
+/// message.
+template<typename T>
+[[nodiscard]] key_value<T> kv(std::string_view key, const T& value) {
+  return {key, value};
+}
+
+
+
+
+
+/// A value which is computed only when it is formatted, see lazy.
+template<typename F>
+struct lazy_value {
+  F compute;
+};
+
+/// Wraps compute as argument which is only evaluated if the entry is actually
+/// formatted, e.g.
+///   logcerr::verbose("state: {}", lazy([&]() { return dump_state(); }));
+/// does not call dump_state unless verbose entries are printed (or kept by the
+/// flight recorder). Format specifications apply to the result of compute.
+/// Callables which take an argument are passed the output iterator instead and
+/// must return the iterator past the last character they write, e.g.
+///   lazy([&](auto out) { return logcerr::format_to(out, "{}", big_struct); })
+/// which writes directly into the buffer of the entry. Since compute may refer
+/// to local variables, lazy values are never captured by deferred formatting.
+/// compute runs before the output lock is taken and may create entries itself,
+/// which are written before the entry it belongs to.
+///
+/// The LOGCERR_* macros of call_site.hpp do not evaluate any argument of a
+/// disabled call site.
+template<typename F>
+[[nodiscard]] lazy_value<std::decay_t<F>> lazy(F&& compute) {
+  return {std::forward<F>(compute)};
+}
+
+template<typename F>
+inline constexpr bool capture_by_value<lazy_value<F>> = false;
+
+
+
+
+
 namespace impl {
   void print(severity, std::string&&);
+  void print(severity, std::string_view, std::string&&, std::string&&);
   void print_checked(severity, std::string&&);
   void print_checked(severity, std::string_view);
+
+  /// Reserves a buffer of the calling thread for one entry until destroyed.
+  /// Holds no buffer if it is disabled or already reserved further up the
+  /// stack, e.g. while formatting an argument which creates an entry itself.
+  class buffer_lease {
+    public:
+      buffer_lease(const buffer_lease&) = delete;
+      buffer_lease(buffer_lease&&)      = delete;
+      buffer_lease& operator=(const buffer_lease&) = delete;
+      buffer_lease& operator=(buffer_lease&&)      = delete;
+
+      buffer_lease() = default;
+
+      buffer_lease(std::string& target, bool& reserved) noexcept {
+        if (!reserved) {
+          reserved = true;
+          buffer   = &target;
+          flag     = &reserved;
+        }
+      }
+
+      ~buffer_lease() {
+        if (flag != nullptr) {
+          *flag = false;
+        }
+      }
+
+      [[nodiscard]] std::string* get() const noexcept { return buffer; }
+
+    private:
+      std::string* buffer{nullptr};
+      bool*        flag  {nullptr};
+  };
+
+  /// Leases the cleared message buffer of the calling thread, which holds no
+  /// buffer if preallocation is disabled.
+  [[nodiscard]] buffer_lease message_buffer();
+
+  /// Creates an entry from the content of message_buffer.
+  void print_buffered(severity, std::string_view);
 }
 
 
@@ -185,6 +548,414 @@ std::string format(format_string<Args...> fmt, Args&&... args) {
   return impl::format::format(std::move(fmt), std::forward<Args>(args)...);
 }
 
+/// Backend agnostic version of std::format_to / fmt::format_to
+template<typename Out, typename... Args>
+Out format_to(Out out, format_string<Args...> fmt, Args&&... args) {
+  return impl::format::format_to(std::move(out), std::move(fmt), std::forward<Args>(args)...);
+}
+
+
+
+
+
+namespace impl {
+  template<typename FormatString>
+  [[nodiscard]] std::string_view view(const FormatString& fstr) {
+  #if defined(STD_FORMAT)
+    return fstr.get();
+  #else
+    auto str = static_cast<fmt::string_view>(fstr);
+    return {str.data(), str.size()};
+  #endif
+  }
+
+
+
+  template<typename T>
+  concept string_like = std::is_convertible_v<const T&, std::string_view>;
+
+  template<typename T>
+  concept deferrable_argument = string_like<T> ||
+    (capture_by_value<T> && std::is_trivially_copyable_v<T> && !std::is_pointer_v<T>)
+    || std::is_same_v<T, const void*>
+    || std::is_same_v<T, void*> || std::is_same_v<T, std::nullptr_t>;
+
+  template<typename... Args>
+  concept deferrable = (deferrable_argument<std::remove_cvref_t<Args>> && ...);
+
+  template<typename T>
+  using stored_t = std::conditional_t<string_like<T>, std::string_view, T>;
+
+
+
+  /// Arguments which are captured instead of being formatted immediately.
+  enum class capture_scope {
+    none,
+    /// Only entries whose arguments can all be written by
+    /// output_encoding::binary, since a binary sink is attached.
+    portable,
+    /// Entries with deferrable arguments, since formatting is deferred.
+    all,
+  };
+
+  [[nodiscard]] capture_scope capturing() noexcept;
+
+
+
+  /// Types of arguments in entries written with output_encoding::binary.
+  enum class argument_tag : char {
+    signed_integer   = 'i',
+    unsigned_integer = 'u',
+    float_number     = 'f',
+    double_number    = 'd',
+    boolean          = 'b',
+    character        = 'c',
+    string           = 's',
+    pointer          = 'p',
+  };
+
+  /// Checks if arguments of type T can be written by output_encoding::binary
+  /// without formatting them.
+  template<typename T>
+  inline constexpr bool portable_argument = std::is_same_v<T, std::string_view>
+    || std::is_same_v<T, float> || std::is_same_v<T, double> || std::is_integral_v<T>
+    || std::is_same_v<T, const void*> || std::is_same_v<T, void*>
+    || std::is_same_v<T, std::nullptr_t>;
+
+  /// Appends value as unsigned LEB128.
+  void append_varint(std::string& out, uint64_t value);
+
+  /// Appends an argument consisting of tag and value as varint.
+  void append_argument(std::string& out, argument_tag tag, uint64_t value);
+
+  /// Appends a string argument.
+  void append_argument(std::string& out, std::string_view text);
+
+  template<typename T>
+  void append_argument(std::string& out, const T& value) {
+    if constexpr (std::is_same_v<T, bool>) {
+      append_argument(out, argument_tag::boolean, value ? 1 : 0);
+    } else if constexpr (std::is_same_v<T, char>) {
+      append_argument(out, argument_tag::character, static_cast<unsigned char>(value));
+    } else if constexpr (std::is_same_v<T, float>) {
+      append_argument(out, argument_tag::float_number, std::bit_cast<uint32_t>(value));
+    } else if constexpr (std::is_same_v<T, double>) {
+      append_argument(out, argument_tag::double_number, std::bit_cast<uint64_t>(value));
+    } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+      // zigzag encoding keeps small negative numbers short
+      const auto wide = static_cast<int64_t>(value);
+      append_argument(out, argument_tag::signed_integer,
+                      (static_cast<uint64_t>(wide) << 1U) ^ static_cast<uint64_t>(wide >> 63));
+    } else if constexpr (std::is_integral_v<T>) {
+      append_argument(out, argument_tag::unsigned_integer, static_cast<uint64_t>(value));
+    } else if constexpr (std::is_same_v<T, std::nullptr_t>) {
+      append_argument(out, argument_tag::pointer, 0);
+    } else {
+      append_argument(out, argument_tag::pointer,
+                      std::bit_cast<uintptr_t>(static_cast<const void*>(value)));
+    }
+  }
+
+
+
+  template<typename T>
+  inline constexpr bool is_key_value = false;
+
+  template<typename T>
+  inline constexpr bool is_key_value<key_value<T>> = true;
+
+
+
+  /// How the text of a field value has to be treated by structured encodings.
+  enum class field_kind : char {
+    string,
+    number,
+    boolean,
+  };
+
+  /// Fields of a single entry, serialized into one buffer as a sequence of
+  /// key length, key, field_kind, value length, and value text.
+  class field_list {
+    public:
+      template<typename T>
+      void add(const key_value<T>& field) {
+        append_size(field.key.size());
+        data.append(field.key);
+        data.push_back(static_cast<char>(kind_of(field.value)));
+
+        const size_t length_at = data.size();
+        append_size(0);
+        format::format_to(std::back_inserter(data), "{}", field.value);
+
+        const size_t length{data.size() - length_at - sizeof(uint32_t)};
+        const auto   stored{static_cast<uint32_t>(length)};
+        std::memcpy(data.data() + length_at, &stored, sizeof(stored));
+      }
+
+      template<typename T>
+      void add(const T& /*not a field*/) {}
+
+      [[nodiscard]] std::string&& release() noexcept { return std::move(data); }
+
+
+
+    private:
+      std::string data;
+
+      void append_size(size_t size) {
+        const auto stored{static_cast<uint32_t>(size)};
+        data.append(reinterpret_cast<const char*>(&stored), // NOLINT(*-reinterpret-cast)
+                    sizeof(stored));
+      }
+
+      template<typename T>
+      [[nodiscard]] static field_kind kind_of(const T& value) {
+        if constexpr (std::is_same_v<T, bool>) {
+          return field_kind::boolean;
+        } else if constexpr (std::is_floating_point_v<T>) {
+          return std::isfinite(value) ? field_kind::number : field_kind::string;
+        } else if constexpr (std::is_integral_v<T> && !std::is_same_v<T, char>) {
+          return field_kind::number;
+        } else {
+          return field_kind::string;
+        }
+      }
+  };
+
+
+
+  /// A message whose formatting has been postponed. Holds a pointer to the
+  /// format string and a binary copy of the arguments.
+  class deferred_message {
+    public:
+      static constexpr size_t capacity{224};
+
+      [[nodiscard]] bool empty() const noexcept { return render == nullptr; }
+
+      void format_to(std::string& out) const {
+        render(out, fmt, storage.data());
+      }
+
+      [[nodiscard]] std::string_view format_string() const noexcept { return fmt; }
+
+      /// Checks if all arguments can be appended by append_arguments.
+      [[nodiscard]] bool portable() const noexcept { return serialize != nullptr; }
+
+      /// Appends the arguments as required by output_encoding::binary.
+      /// Must only be called if portable() returns true.
+      void append_arguments(std::string& out) const {
+        serialize(out, storage.data());
+      }
+
+
+
+      template<typename... Args>
+      [[nodiscard]] bool capture(std::string_view fstr, const Args&... args) {
+        [[maybe_unused]] size_t offset{0};
+        if (!(encode<stored_t<std::remove_cvref_t<Args>>>(offset, args) && ...)) {
+          return false;
+        }
+
+        fmt    = fstr;
+        render = &render_with<stored_t<std::remove_cvref_t<Args>>...>;
+
+        if constexpr ((portable_argument<stored_t<std::remove_cvref_t<Args>>> && ...)) {
+          serialize = &serialize_with<stored_t<std::remove_cvref_t<Args>>...>;
+        } else {
+          serialize = nullptr;
+        }
+
+        return true;
+      }
+
+
+
+    private:
+      using render_fn    = void(*)(std::string&, std::string_view, const std::byte*);
+      using serialize_fn = void(*)(std::string&, const std::byte*);
+
+      render_fn        render{nullptr};
+      serialize_fn     serialize{nullptr};
+      std::string_view fmt;
+
+      alignas(std::max_align_t) std::array<std::byte, capacity> storage; // NOLINT(*-member-init)
+
+
+
+      [[nodiscard]] static size_t align(size_t offset, size_t alignment) {
+        return (offset + alignment - 1) / alignment * alignment;
+      }
+
+
+
+      template<typename Stored, typename T>
+      [[nodiscard]] bool encode(size_t& offset, const T& value) {
+        if constexpr (std::is_same_v<Stored, std::string_view>) {
+          const std::string_view str{value};
+
+          offset = align(offset, alignof(size_t));
+          if (capacity - offset < sizeof(size_t) || capacity - offset - sizeof(size_t) < str.size()) {
+            return false;
+          }
+
+          const size_t length{str.size()};
+          std::memcpy(storage.data() + offset, &length, sizeof(length));
+          std::memcpy(storage.data() + offset + sizeof(length), str.data(), length);
+          offset += sizeof(length) + length;
+        } else {
+          offset = align(offset, alignof(Stored));
+          if (capacity - offset < sizeof(Stored)) {
+            return false;
+          }
+
+          std::memcpy(storage.data() + offset, &value, sizeof(Stored));
+          offset += sizeof(Stored);
+        }
+
+        return true;
+      }
+
+
+
+      template<typename Stored>
+      [[nodiscard]] static Stored decode(const std::byte* data, size_t& offset) {
+        if constexpr (std::is_same_v<Stored, std::string_view>) {
+          offset = align(offset, alignof(size_t));
+
+          size_t length{};
+          std::memcpy(&length, data + offset, sizeof(length));
+          offset += sizeof(length) + length;
+
+          //NOLINTNEXTLINE(*-reinterpret-cast)
+          return {reinterpret_cast<const char*>(data + offset - length), length};
+        } else {
+          offset = align(offset, alignof(Stored));
+
+          std::array<std::byte, sizeof(Stored)> bytes{};
+          std::memcpy(bytes.data(), data + offset, sizeof(Stored));
+          offset += sizeof(Stored);
+
+          return std::bit_cast<Stored>(bytes);
+        }
+      }
+
+
+
+      template<typename... Stored>
+      static void render_with(
+          std::string&                      out,
+          std::string_view                  fstr,
+          [[maybe_unused]] const std::byte* data
+      ) {
+        [[maybe_unused]] size_t offset{0};
+        // braced initialization guarantees left-to-right evaluation
+        std::tuple<Stored...> values{decode<Stored>(data, offset)...};
+
+        std::apply([&](auto&... value) {
+          format::vformat_to(std::back_inserter(out), fstr, format::make_format_args(value...));
+        }, values);
+      }
+
+
+
+      template<typename... Stored>
+      static void serialize_with(std::string& out, [[maybe_unused]] const std::byte* data) {
+        [[maybe_unused]] size_t offset{0};
+        (append_argument(out, decode<Stored>(data, offset)), ...);
+      }
+  };
+
+
+
+  void print(severity, std::string_view, const deferred_message&);
+
+
+
+  /// Checks if the flight recorder is active (see flight_recorder.hpp).
+  [[nodiscard]] bool recording() noexcept;
+
+  /// Set while the flight recorder is active or statistics are collected,
+  /// which are the only users of entries not created due to their severity.
+  inline std::atomic<bool> observing_filtered{false};
+
+  /// Counts an entry which is not created due to its severity if statistics
+  /// are collected and returns recording().
+  [[nodiscard]] bool observe_filtered(severity level) noexcept;
+
+  /// Called for entries which are not created due to their severity. Only
+  /// takes a single relaxed load unless observing_filtered is set.
+  [[nodiscard]] inline bool filtered_out(severity level) noexcept {
+    return observing_filtered.load(std::memory_order_relaxed) && observe_filtered(level);
+  }
+
+  void record_flight(severity level, std::string_view message) noexcept;
+
+  /// Leases the cleared buffer of the calling thread used for entries which
+  /// are only recorded.
+  [[nodiscard]] buffer_lease record_buffer();
+
+  /// Writes an entry which is not outputted to the flight recorder only.
+  template<typename... Args>
+  void record_unchecked(severity level, format_string<Args...> fmt, Args&&... args) {
+    if (const auto lease = record_buffer(); auto* buffer = lease.get()) {
+      format::format_to(std::back_inserter(*buffer), std::move(fmt),
+                        std::forward<Args>(args)...);
+      record_flight(level, *buffer);
+      return;
+    }
+
+    record_flight(level, logcerr::format(std::move(fmt), std::forward<Args>(args)...));
+  }
+
+
+
+  /// Creates an entry without checking output_level. category is the name
+  /// of a logcerr::category (see category.hpp) or empty.
+  template<typename... Args>
+  void print_unchecked(
+      std::string_view        category,
+      severity                level,
+      format_string<Args...>  fmt,
+      Args&&...               args
+  ) {
+    if constexpr ((is_key_value<std::remove_cvref_t<Args>> || ...)) {
+      field_list fields;
+      (fields.add(args), ...);
+
+      print(level, category, logcerr::format(std::move(fmt), std::forward<Args>(args)...),
+            fields.release());
+      return;
+    }
+
+    if constexpr (deferrable<Args...>) {
+      constexpr bool portable{(portable_argument<stored_t<std::remove_cvref_t<Args>>> && ...)};
+
+      if (const auto scope = capturing();
+          scope == capture_scope::all || (portable && scope == capture_scope::portable)) {
+        if (deferred_message message; message.capture(view(fmt), args...)) {
+          print(level, category, message);
+          return;
+        }
+      }
+    }
+
+    if (const auto lease = message_buffer(); auto* buffer = lease.get()) {
+      format::format_to(std::back_inserter(*buffer), std::move(fmt), std::forward<Args>(args)...);
+      print_buffered(level, category);
+      return;
+    }
+
+    print(level, category, logcerr::format(std::move(fmt), std::forward<Args>(args)...), {});
+  }
+
+
+
+  template<typename... Args>
+  void print_unchecked(severity level, format_string<Args...> fmt, Args&&... args) {
+    print_unchecked(std::string_view{}, level, std::move(fmt), std::forward<Args>(args)...);
+  }
+}
+
 
 
 
@@ -192,8 +963,9 @@ std::string format(format_string<Args...> fmt, Args&&... args) {
 template<typename... Args>
 void print(severity level, format_string<Args...> fmt, Args&&... args) {
   if (is_outputted(level)) {
-    impl::print(level,
-                logcerr::format(std::move(fmt), std::forward<Args>(args)...));
+    impl::print_unchecked(level, std::move(fmt), std::forward<Args>(args)...);
+  } else if (impl::filtered_out(level)) {
+    impl::record_unchecked(level, std::move(fmt), std::forward<Args>(args)...);
   }
 }
 
@@ -273,4 +1045,40 @@ inline void error(std::string_view message) {
 
 }
 
+
+
+
+
+template<typename T>
+struct logcerr::impl::format::formatter<logcerr::key_value<T>> {
+  constexpr auto parse(auto& ctx) { return ctx.begin(); }
+
+  auto format(const logcerr::key_value<T>& field, auto& ctx) const {
+    return logcerr::impl::format::format_to(ctx.out(), "{}={}", field.key, field.value);
+  }
+};
+
+
+
+template<typename F>
+  requires std::invocable<const F&>
+struct logcerr::impl::format::formatter<logcerr::lazy_value<F>> :
+  logcerr::impl::format::formatter<std::remove_cvref_t<std::invoke_result_t<const F&>>>
+{
+  auto format(const logcerr::lazy_value<F>& value, auto& ctx) const {
+    using result = std::remove_cvref_t<std::invoke_result_t<const F&>>;
+    return logcerr::impl::format::formatter<result>::format(value.compute(), ctx);
+  }
+};
+
+template<typename F>
+  requires (!std::invocable<const F&>)
+struct logcerr::impl::format::formatter<logcerr::lazy_value<F>> {
+  constexpr auto parse(auto& ctx) { return ctx.begin(); }
+
+  auto format(const logcerr::lazy_value<F>& value, auto& ctx) const {
+    return value.compute(ctx.out());
+  }
+};
+
 #endif // LOGCERR_LOG_HPP_INCLUDED
@@ -0,0 +1,83 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#ifndef LOGCERR_LOG_INDEX_HPP_INCLUDED
+#define LOGCERR_LOG_INDEX_HPP_INCLUDED
+
+#include "logcerr/log.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <vector>
+
+
+
+namespace logcerr {
+
+/// A range of consecutive entries in a file written by an indexed_sink.
+struct index_block {
+  /// Offset of the first byte of the block.
+  uint64_t                  begin{0};
+  /// Offset one past the last byte of the block.
+  uint64_t                  end{0};
+  /// Earliest time of the entries in this block.
+  std::chrono::microseconds earliest{0};
+  /// Latest time of all entries up to the end of this block, including those
+  /// of previous blocks, so that it never decreases.
+  std::chrono::microseconds latest{0};
+  /// Number of entries per severity, indexed by severity.
+  std::array<uint32_t, 5>   entries{};
+
+  [[nodiscard]] uint32_t count(severity level) const {
+    return entries.at(static_cast<size_t>(level));
+  }
+};
+
+
+
+/// A range of bytes of an indexed file. end is unbounded if the range extends
+/// past the last block, e.g. into entries written after the last flush.
+struct byte_range {
+  static constexpr uint64_t unbounded{std::numeric_limits<uint64_t>::max()};
+
+  uint64_t begin{0};
+  uint64_t end{unbounded};
+};
+
+
+
+/// The index written by an indexed_sink next to its file.
+class log_index {
+  public:
+    /// Reads the index at index_path, e.g. indexed_sink::index_path().
+    ///
+    /// @throws std::system_error if the file cannot be read
+    /// @throws std::runtime_error if the file is not an index
+    explicit log_index(const std::filesystem::path& index_path);
+
+    [[nodiscard]] const std::vector<index_block>& blocks() const noexcept { return list; }
+
+    /// Finds the range of bytes holding all entries created in [from, until)
+    /// by a binary search for the first block. The range starts and ends at
+    /// block boundaries, so it may contain entries outside of the interval.
+    /// Entries are expected in the order of their time, except for entries
+    /// which have been delayed by less than a block, e.g. while waiting for
+    /// the output lock.
+    [[nodiscard]] byte_range find(std::chrono::microseconds from,
+                                  std::chrono::microseconds until) const;
+
+    /// Obtains all blocks containing entries of at least severity level.
+    [[nodiscard]] std::vector<index_block> find(severity level) const;
+
+
+
+  private:
+    std::vector<index_block> list;
+};
+
+}
+
+#endif // LOGCERR_LOG_INDEX_HPP_INCLUDED
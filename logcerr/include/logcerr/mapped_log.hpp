@@ -0,0 +1,66 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#ifndef LOGCERR_MAPPED_LOG_HPP_INCLUDED
+#define LOGCERR_MAPPED_LOG_HPP_INCLUDED
+
+#include "logcerr/log.hpp"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+
+
+namespace logcerr {
+
+/// Describes how the file of a mapped log grows and rolls over.
+struct mapped_log_options {
+  /// Number of bytes the file is extended by whenever it fills up.
+  size_t grow_by{size_t{16} << 20U};
+  /// Maximum size of a single file. Once it is full, the file is renamed to
+  /// path.1 (see rotation_policy) and a new file is started. Entries larger
+  /// than max_size are discarded.
+  size_t max_size{size_t{1} << 30U};
+  /// Number of full files to keep as path.1 (newest) to path.keep (oldest).
+  size_t keep{5};
+  /// If true, entries are only written to the mapped log and not to the
+  /// attached sinks, so that creating an entry never takes the output lock.
+  bool   exclusive{true};
+};
+
+/// Starts writing every entry to a file at path which is mapped into memory.
+/// The file is created or truncated. Every entry is formatted on the calling
+/// thread in the layout used for stderr without colors and merging. Writers
+/// claim a range of the file with a single atomic addition and copy the entry
+/// into it, without a system call and without taking the output lock.
+///
+/// The file is extended in steps of grow_by bytes, which are filled with NUL
+/// bytes until written. Ranges which were claimed but not completely written,
+/// e.g. because the process crashed, are therefore recognizable by their NUL
+/// bytes and skipped by read_mapped_log. Once the mapped log is stopped or the
+/// program exits, the file is truncated to its used size.
+///
+/// Calling this function while a mapped log is active replaces it. If both
+/// write to the same file, the active file is rotated first like a full one.
+///
+/// @throws std::system_error if the file cannot be created or mapped
+/// @throws std::invalid_argument if grow_by or max_size is 0
+void mapped_log(const std::filesystem::path& path, const mapped_log_options& options = {});
+
+/// Checks if a mapped log is active.
+[[nodiscard]] bool mapped_log() noexcept;
+
+/// Stops writing to the mapped log after all pending writes have completed.
+void stop_mapped_log();
+
+/// Reads the lines of a mapped log file without their line breaks. Runs of NUL
+/// bytes left behind by entries which were not written completely are skipped
+/// together with the incomplete text in front of them.
+///
+/// @throws std::system_error if the file cannot be read
+[[nodiscard]] std::vector<std::string> read_mapped_log(const std::filesystem::path& path);
+
+}
+
+#endif // LOGCERR_MAPPED_LOG_HPP_INCLUDED
@@ -0,0 +1,391 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#ifndef LOGCERR_SINK_HPP_INCLUDED
+#define LOGCERR_SINK_HPP_INCLUDED
+
+#include "logcerr/log.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+
+namespace logcerr {
+
+namespace impl {
+  class backlog;
+  class flusher;
+  class ring;
+  class rotator;
+}
+
+
+
+/// Metadata of a log entry handed to a sink together with its formatted text.
+struct entry_info {
+  severity                  level;
+  std::chrono::microseconds time;
+  std::string_view          thread_name;
+  /// Name of the category which created the entry, empty if none.
+  std::string_view          category;
+  std::string_view          message;
+  /// Number of times this entry has been created in a row, or the number of
+  /// entries withheld if it reports them (see merge_window).
+  size_t                    count;
+  /// True if the text replaces the last line previously written for this
+  /// entry, which happens when merged entries update their counter.
+  bool                      update;
+};
+
+
+
+/// A destination for log output.
+/// All member functions are called while the output lock is held, so
+/// implementations need no further synchronization for output, but must not
+/// create log entries themselves.
+class sink {
+  public:
+    sink(const sink&) = delete;
+    sink(sink&&)      = delete;
+    sink& operator=(const sink&) = delete;
+    sink& operator=(sink&&)      = delete;
+
+    sink()          = default;
+    virtual ~sink() = default;
+
+    /// Writes text formatted for a terminal. If info is nullptr, text does not
+    /// belong to an entry, e.g. the line break terminating a merged entry.
+    virtual void write(const entry_info* info, std::string_view text) = 0;
+
+    /// Writes all buffered output.
+    virtual void flush() {}
+
+    /// Checks if the sink is connected to a terminal. Used to resolve
+    /// color_mode::auto_detect when the sink is attached.
+    [[nodiscard]] virtual bool terminal() const { return false; }
+};
+
+
+
+/// An enum describing how entries are written to a sink.
+enum class output_encoding {
+  /// The human-readable layout also used for stderr, including merging.
+  text,
+  /// One JSON object per line with the members time, level, thread, message,
+  /// count (if an entry has been repeated), and all fields attached with kv.
+  json_lines,
+  /// One line of logfmt per entry with the same keys as json_lines, using msg
+  /// for the message.
+  logfmt,
+  /// Compact binary records holding the time, severity, interned thread name,
+  /// category, and format string, and the raw arguments of an entry, see
+  /// binary.hpp. While a sink with this encoding is attached, strings,
+  /// integers, floating point numbers, and pointers are captured like with
+  /// defer_formatting, so that entries with only such arguments which are
+  /// only written to binary sinks are never formatted. Every repetition of a merged
+  /// entry is written as a separate record. Each sink starts its output with a
+  /// header; appending to an existing log, e.g. with file_sink, is supported by
+  /// binary_reader. Binary sinks should not write to a rotating_file_sink, whose
+  /// later files would lack a header.
+  binary,
+};
+
+
+
+/// Settings of a sink which are applied by the library.
+struct sink_options {
+  /// Only entries of at least this severity are written to the sink.
+  /// Entries below output_level are never created, regardless of this value.
+  severity                  level{severity::debug};
+  /// Overrides the color_mode set by colorize for this sink. Only applies to
+  /// output_encoding::text.
+  std::optional<color_mode> color;
+  /// Structured encodings write every repetition of a merged entry as a
+  /// separate line.
+  output_encoding           encoding{output_encoding::text};
+};
+
+/// Adds target to the sinks receiving log output. Every entry is formatted at
+/// most once per encoding and color variant, regardless of the number of sinks.
+/// Attaching a sink which is already attached updates its options.
+/// The sink returned by stderr_sink is attached by default.
+void attach(std::shared_ptr<sink> target, const sink_options& options = {});
+
+/// Removes target from the sinks receiving log output after flushing it.
+void detach(const std::shared_ptr<sink>& target);
+
+/// Removes all sinks, including the default one.
+void detach_all();
+
+
+
+
+
+/// A sink writing to a file descriptor. Unless interrupted by a signal, a full
+/// device, or buffering, every entry is written in a single call.
+class fd_sink : public sink {
+  public:
+    fd_sink(const fd_sink&) = delete;
+    fd_sink(fd_sink&&)      = delete;
+    fd_sink& operator=(const fd_sink&) = delete;
+    fd_sink& operator=(fd_sink&&)      = delete;
+
+    /// Writes to fd, which is closed on destruction if owned is true.
+    fd_sink(int fd, bool owned);
+
+    ~fd_sink() override;
+
+    void write(const entry_info* info, std::string_view text) override;
+    void flush() override;
+
+    [[nodiscard]] bool terminal() const override;
+
+    [[nodiscard]] int descriptor() const noexcept { return fd; }
+
+
+
+    /// Sets the buffer_policy of this sink. Pending output is written before
+    /// the policy changes.
+    void buffering(const buffer_policy& policy);
+
+    /// Obtains the current buffer_policy of this sink.
+    [[nodiscard]] buffer_policy buffering() const;
+
+
+
+    /// Sets the backlog_policy of this sink, see logcerr::nonblocking. The
+    /// pending backlog is written before the policy changes.
+    ///
+    /// @throws std::invalid_argument if overload is not a named value of
+    ///   overload_policy
+    /// @throws std::system_error if the mode of the descriptor cannot be changed
+    void nonblocking(const backlog_policy& policy);
+
+    /// Obtains the current backlog_policy of this sink.
+    [[nodiscard]] backlog_policy nonblocking() const;
+
+
+
+    /// Sets the uring_policy of this sink, see logcerr::uring. Sockets are
+    /// always written with plain calls. Pending output is written before the
+    /// policy changes.
+    ///
+    /// @throws std::invalid_argument if count is above 0 and size is 0
+    void uring(const uring_policy& policy);
+
+    /// Obtains the uring_policy in effect for this sink.
+    [[nodiscard]] uring_policy uring() const;
+
+
+
+  private:
+    int  fd;
+    bool owned;
+    bool socket;
+
+    // guarded by output_mutex
+    buffer_policy                         policy;
+    std::string                           buffer;
+    severity                              buffer_level{severity::debug};
+    std::chrono::steady_clock::time_point pending_since;
+    std::unique_ptr<impl::backlog>        pending;
+    std::unique_ptr<impl::ring>           submissions;
+
+    std::mutex                      flusher_mutex;
+    std::unique_ptr<impl::flusher>  timer; // guarded by flusher_mutex
+
+    void write_unbuffered(std::string_view data, severity level);
+    void flush_buffer();
+
+    friend class impl::flusher;
+};
+
+/// Obtains the sink writing to stderr, which is attached by default.
+/// The global buffering functions forward to this sink.
+[[nodiscard]] std::shared_ptr<fd_sink> stderr_sink();
+
+/// Creates a sink appending to the file at path, which is created if it does
+/// not exist. The file is opened with O_APPEND, so that several processes can
+/// share it.
+///
+/// @throws std::system_error if the file cannot be opened
+[[nodiscard]] std::shared_ptr<fd_sink> file_sink(const std::filesystem::path& path);
+
+/// Creates a sink sending entries to the Unix domain socket at path.
+/// With datagram set, every entry is sent as a separate datagram as long as
+/// buffering is disabled. Entries are dropped if the receiver is unavailable.
+///
+/// @throws std::system_error if the socket cannot be connected
+[[nodiscard]] std::shared_ptr<fd_sink> unix_socket_sink(
+    const std::filesystem::path& path, bool datagram = true);
+
+
+
+
+
+/// Describes when a rotating_file_sink starts a new file.
+struct rotation_policy {
+  /// Rotate once the file holds at least size bytes; 0 disables size based
+  /// rotation.
+  size_t               size{0};
+  /// Rotate once the file has been written to for interval; empty files are
+  /// never rotated. 0 disables time based rotation.
+  std::chrono::seconds interval{0};
+  /// Number of rotated files to keep as path.1 (newest) to path.keep (oldest).
+  size_t               keep{5};
+};
+
+/// A sink appending to a file which is rotated according to a rotation_policy.
+/// Rotation is performed by a background thread, so that renaming, reopening,
+/// and pruning files never happens while a logging thread holds the output
+/// lock. Files are opened with O_APPEND and rotation is coordinated through
+/// flock, so that several processes can share a destination: a process which
+/// finds that the file has been rotated by another one only reopens it.
+class rotating_file_sink : public sink {
+  public:
+    rotating_file_sink(const rotating_file_sink&) = delete;
+    rotating_file_sink(rotating_file_sink&&)      = delete;
+    rotating_file_sink& operator=(const rotating_file_sink&) = delete;
+    rotating_file_sink& operator=(rotating_file_sink&&)      = delete;
+
+    /// @throws std::system_error if the file cannot be opened
+    rotating_file_sink(std::filesystem::path path, const rotation_policy& policy);
+
+    ~rotating_file_sink() override;
+
+    void write(const entry_info* info, std::string_view text) override;
+
+    /// Requests a rotation independent of the rotation_policy, e.g. after
+    /// receiving SIGHUP. Returns without waiting for the rotation.
+    void rotate();
+
+    [[nodiscard]] const std::filesystem::path& path() const noexcept { return file; }
+
+
+
+  private:
+    std::filesystem::path file;
+    rotation_policy       policy;
+
+    // guarded by output_mutex
+    int                       fd{-1};
+    size_t                    written{0};
+    std::chrono::microseconds rotate_at{0};
+    bool                      requested{false};
+
+    std::unique_ptr<impl::rotator> worker;
+
+    friend class impl::rotator;
+};
+
+
+
+
+
+/// Describes when an indexed_sink adds a block to its index.
+struct index_policy {
+  /// Close a block once it holds this many entries; 0 disables the limit.
+  size_t entries{4096};
+  /// Close a block once it spans at least this many bytes; 0 disables the limit.
+  size_t bytes{size_t{1} << 20U};
+};
+
+/// A sink writing to a file together with a sparse index in the side-car file
+/// path.idx, which allows finding entries by time and severity without reading
+/// the whole file, see log_index.hpp.
+/// The file is divided into blocks of consecutive entries according to an
+/// index_policy. Once a block is closed, or the sink is flushed, its range of
+/// bytes, the earliest and latest time, and the number of entries per severity
+/// are appended to the index. Times are those of elapsed. Both files are
+/// truncated when the sink is created and must not be shared with other
+/// processes.
+class indexed_sink : public sink {
+  public:
+    indexed_sink(const indexed_sink&) = delete;
+    indexed_sink(indexed_sink&&)      = delete;
+    indexed_sink& operator=(const indexed_sink&) = delete;
+    indexed_sink& operator=(indexed_sink&&)      = delete;
+
+    /// @throws std::system_error if one of the files cannot be opened
+    indexed_sink(std::filesystem::path path, const index_policy& policy);
+
+    ~indexed_sink() override;
+
+    void write(const entry_info* info, std::string_view text) override;
+    void flush() override;
+
+    [[nodiscard]] const std::filesystem::path& path() const noexcept { return file; }
+    [[nodiscard]] std::filesystem::path index_path() const;
+
+    /// Obtains the sink writing the file, e.g. to set its buffer_policy.
+    [[nodiscard]] const std::shared_ptr<fd_sink>& output() const noexcept { return target; }
+
+
+
+  private:
+    std::filesystem::path    file;
+    index_policy             policy;
+    std::shared_ptr<fd_sink> target;
+    int                      index_fd{-1};
+
+    // guarded by output_mutex
+    uint64_t                  offset{0};
+    uint64_t                  begin{0};
+    size_t                    entries{0};
+    std::chrono::microseconds earliest{0};
+    std::chrono::microseconds latest{0};
+    std::array<uint32_t, 5>   counts{};
+
+    void close_block();
+};
+
+
+
+
+
+/// A sink keeping the last entries in memory, e.g. for showing them in a user
+/// interface or attaching them to a crash report.
+class ring_sink : public sink {
+  public:
+    ring_sink(const ring_sink&) = delete;
+    ring_sink(ring_sink&&)      = delete;
+    ring_sink& operator=(const ring_sink&) = delete;
+    ring_sink& operator=(ring_sink&&)      = delete;
+
+    ~ring_sink() override = default;
+
+    /// Keeps up to capacity entries.
+    ///
+    /// @throws std::invalid_argument if capacity is 0
+    explicit ring_sink(size_t capacity);
+
+    void write(const entry_info* info, std::string_view text) override;
+
+    /// Obtains the stored entries from oldest to newest. Lines of multi-line
+    /// entries are separated by '\n', entries do not end with a line break.
+    [[nodiscard]] std::vector<std::string> entries() const;
+
+    void clear();
+
+
+
+  private:
+    size_t capacity;
+
+    mutable std::mutex      mutex;
+    std::deque<std::string> lines; // guarded by mutex
+};
+
+}
+
+#endif // LOGCERR_SINK_HPP_INCLUDED
@@ -0,0 +1,77 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#ifndef LOGCERR_STATS_HPP_INCLUDED
+#define LOGCERR_STATS_HPP_INCLUDED
+
+#include "logcerr/log.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+
+
+namespace logcerr {
+
+/// Distribution of durations in buckets of powers of two nanoseconds.
+struct latency_histogram {
+  static constexpr size_t bucket_count{32};
+
+  /// buckets[0] counts durations below 1ns, buckets[i] durations in
+  /// [2^(i-1), 2^i) ns. The last bucket also counts all longer durations.
+  std::array<uint64_t, bucket_count> buckets{};
+  uint64_t                           count{0};
+  std::chrono::nanoseconds           total{0};
+  std::chrono::nanoseconds           max{0};
+
+  /// Obtains an upper bound of the duration below which a fraction p of all
+  /// samples lies, e.g. percentile(0.99). Returns 0 if there are no samples.
+  [[nodiscard]] std::chrono::nanoseconds percentile(double p) const;
+};
+
+
+
+/// A snapshot of the counters of this library.
+struct statistics {
+  /// Number of entries created per severity, indexed by severity.
+  std::array<uint64_t, 5> entries{};
+  /// Number of entries not created since they were below output_level or
+  /// disabled by their call site or category.
+  uint64_t                filtered{0};
+  /// Number of entries absorbed into the previous entry by merging.
+  uint64_t                merged{0};
+  /// Number of bytes handed to sinks.
+  uint64_t                bytes{0};
+  /// Time spent waiting for the output lock when writing an entry.
+  latency_histogram       lock_wait;
+  /// Time the output lock has been held when writing an entry.
+  latency_histogram       lock_hold;
+
+  [[nodiscard]] uint64_t created(severity level) const {
+    return entries.at(static_cast<size_t>(level));
+  }
+};
+
+
+
+/// Enables or disables collecting statistics. Counters are sharded across
+/// threads, so collecting adds a few uncontended atomic increments and two
+/// clock reads per entry, three if the output lock has to be waited for.
+/// Collecting is disabled by default.
+void collect_stats(bool enable) noexcept;
+
+/// Checks if statistics are collected.
+[[nodiscard]] bool collect_stats() noexcept;
+
+/// Obtains the sum of all counters since the start or the last reset_stats.
+/// Counters are read individually, so the snapshot is only consistent if no
+/// entries are created concurrently.
+[[nodiscard]] statistics stats();
+
+/// Sets all counters to zero.
+void reset_stats() noexcept;
+
+}
+
+#endif // LOGCERR_STATS_HPP_INCLUDED
@@ -0,0 +1,405 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/log.hpp"
+#include "src/output.hpp"
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+
+
+
+
+namespace {
+  #ifdef __cpp_lib_hardware_interference_size
+  constexpr size_t cache_line{std::hardware_destructive_interference_size};
+  #else
+  constexpr size_t cache_line{64};
+  #endif
+
+
+
+  // Bounded multi-producer single-consumer queue based on per-cell sequence
+  // numbers (Vyukov). Producers never block each other; the consumer never
+  // takes a lock. Records are swapped with the content of cells, so that the
+  // buffers of written records are handed back to producers for reuse.
+  class mpsc_queue {
+    public:
+      explicit mpsc_queue(size_t capacity) :
+        mask {std::bit_ceil(capacity) - 1},
+        cells{std::make_unique<cell[]>(mask + 1)}
+      {
+        for (size_t i = 0; i <= mask; ++i) {
+          cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+      }
+
+
+
+      [[nodiscard]] bool try_push(logcerr::impl::record& rec) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+
+        while (true) {
+          auto& current = cells[pos & mask];
+          auto  seq     = current.sequence.load(std::memory_order_acquire);
+          auto  diff    = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+
+          if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                                  std::memory_order_relaxed)) {
+              std::swap(current.value, rec);
+              current.sequence.store(pos + 1, std::memory_order_release);
+              return true;
+            }
+          } else if (diff < 0) {
+            return false;
+          } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+          }
+        }
+      }
+
+
+
+      // must only be called by the consumer
+      [[nodiscard]] bool try_pop(logcerr::impl::record& rec) {
+        auto& current = cells[dequeue_pos & mask];
+
+        if (current.sequence.load(std::memory_order_acquire) != dequeue_pos + 1) {
+          return false;
+        }
+
+        std::swap(rec, current.value);
+        current.sequence.store(dequeue_pos + mask + 1, std::memory_order_release);
+        ++dequeue_pos;
+
+        return true;
+      }
+
+
+
+      [[nodiscard]] size_t pushed() const {
+        return enqueue_pos.load(std::memory_order_acquire);
+      }
+
+
+
+    private:
+      struct cell {
+        std::atomic<size_t>    sequence;
+        logcerr::impl::record value;
+      };
+
+      size_t                  mask;
+      std::unique_ptr<cell[]> cells;
+
+      alignas(cache_line) std::atomic<size_t> enqueue_pos{0};
+      alignas(cache_line) size_t              dequeue_pos{0};
+  };
+
+
+
+
+
+  class writer;
+
+  // set on the thread of a writer, which must not wait for its own queue
+  thread_local writer* own_writer{nullptr};
+
+
+
+  class writer {
+    public:
+      writer(const writer&) = delete;
+      writer(writer&&)      = delete;
+      writer& operator=(const writer&) = delete;
+      writer& operator=(writer&&)      = delete;
+
+      explicit writer(size_t capacity) :
+        queue{capacity},
+        thread{[this]() { run(); }}
+      {}
+
+      ~writer() {
+        running.store(false);
+        wake();
+        thread.join();
+      }
+
+
+
+      void push(logcerr::impl::record& rec) {
+        while (!queue.try_push(rec)) {
+          if (idle.exchange(false)) {
+            wake();
+          }
+          std::this_thread::yield();
+        }
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (idle.load(std::memory_order_relaxed) && idle.exchange(false)) {
+          wake();
+        }
+      }
+
+
+
+      // Must only be called by the writer thread, i.e. by formatters and sinks
+      // run while draining. The record is printed after the current one
+      // without going through the queue, which may be full.
+      void push_own(logcerr::impl::record& rec) {
+        own.emplace_back();
+        std::swap(own.back(), rec);
+      }
+
+
+
+      void flush() {
+        auto target = queue.pushed();
+
+        for (auto current = written.load(); current < target; current = written.load()) {
+          written.wait(current);
+        }
+      }
+
+
+
+    private:
+      mpsc_queue queue;
+
+      std::atomic<bool>     running{true};
+      std::atomic<bool>     idle   {false};
+      std::atomic<uint32_t> wakeups{0};
+      std::atomic<size_t>   written{0};
+
+      // only accessed by the writer thread
+      logcerr::impl::record             spare;
+      std::deque<logcerr::impl::record> own;
+
+      std::thread thread;
+
+
+
+      void wake() {
+        wakeups.fetch_add(1);
+        wakeups.notify_one();
+      }
+
+
+
+      // returns the number of records written
+      size_t drain() {
+        static constexpr size_t max_batch{64};
+
+        auto& rec = spare;
+        if (!queue.try_pop(rec)) {
+          return 0;
+        }
+
+        size_t count{0};
+        {
+          const logcerr::impl::output_guard lock;
+
+          do {
+            logcerr::impl::print_unguarded(std::move(rec));
+            ++count;
+
+            // references stay valid while printing appends further records
+            while (!own.empty()) {
+              logcerr::impl::print_unguarded(std::move(own.front()));
+              own.pop_front();
+            }
+          } while (count < max_batch && queue.try_pop(rec));
+        }
+
+        written.fetch_add(count);
+        written.notify_all();
+
+        return count;
+      }
+
+
+
+      void run() {
+        own_writer = this;
+
+        while (true) {
+          if (drain() > 0) {
+            continue;
+          }
+
+          auto token = wakeups.load();
+          idle.store(true);
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+
+          if (drain() > 0) {
+            idle.store(false);
+            continue;
+          }
+
+          if (!running.load()) {
+            break;
+          }
+
+          wakeups.wait(token);
+          idle.store(false);
+        }
+      }
+  };
+
+
+
+
+
+  namespace global_state {
+    std::mutex           writer_mutex;
+    std::atomic<writer*> current_writer{nullptr};
+    std::atomic<size_t>  producers     {0};
+
+    std::atomic<bool>    deferred      {false};
+  }
+
+
+
+  // Detaches the active writer such that no new records can reach it.
+  // Requires writer_mutex to be held.
+  std::unique_ptr<writer> detach_writer() {
+    std::unique_ptr<writer> old{global_state::current_writer.exchange(nullptr)};
+
+    for (auto active = global_state::producers.load(); active > 0;
+         active = global_state::producers.load()) {
+      std::this_thread::yield();
+    }
+
+    return old;
+  }
+
+
+
+  class producer_guard {
+    public:
+      producer_guard(const producer_guard&) = delete;
+      producer_guard(producer_guard&&)      = delete;
+      producer_guard& operator=(const producer_guard&) = delete;
+      producer_guard& operator=(producer_guard&&)      = delete;
+
+      producer_guard() {
+        global_state::producers.fetch_add(1);
+      }
+
+      ~producer_guard() {
+        global_state::producers.fetch_sub(1);
+      }
+  };
+}
+
+
+
+
+
+bool logcerr::impl::enqueue(record& rec) {
+  // the writer holds the output lock while running formatters and sinks, so
+  // their entries can neither wait for the queue nor be printed directly
+  if (own_writer != nullptr) {
+    own_writer->push_own(rec);
+    return true;
+  }
+
+  if (global_state::current_writer.load(std::memory_order_relaxed) == nullptr) {
+    return false;
+  }
+
+  const producer_guard guard;
+
+  auto* active = global_state::current_writer.load();
+  if (active == nullptr) {
+    return false;
+  }
+
+  active->push(rec);
+  return true;
+}
+
+
+
+void logcerr::impl::stop_writer() {
+  const std::lock_guard<std::mutex> lock{global_state::writer_mutex};
+
+  detach_writer();
+}
+
+
+
+
+
+void logcerr::asynchronous(bool enable, size_t capacity) {
+  if (capacity == 0) {
+    throw std::invalid_argument{"expected a positive queue capacity"};
+  }
+
+  const std::lock_guard<std::mutex> lock{global_state::writer_mutex};
+
+  detach_writer();
+
+  if (enable) {
+    global_state::current_writer = std::make_unique<writer>(capacity).release();
+  }
+}
+
+
+
+bool logcerr::asynchronous() noexcept {
+  return global_state::current_writer.load() != nullptr;
+}
+
+
+
+void logcerr::impl::flush_writer() {
+  if (writer_thread()) {
+    return;
+  }
+
+  const producer_guard guard;
+
+  if (auto* active = global_state::current_writer.load()) {
+    active->flush();
+  }
+}
+
+
+
+bool logcerr::impl::writer_thread() noexcept {
+  return own_writer != nullptr;
+}
+
+
+
+logcerr::impl::capture_scope logcerr::impl::capturing() noexcept {
+  if (global_state::deferred.load(std::memory_order_relaxed)
+      && global_state::current_writer.load(std::memory_order_relaxed) != nullptr) {
+    return capture_scope::all;
+  }
+
+  return binary_output() ? capture_scope::portable : capture_scope::none;
+}
+
+
+
+void logcerr::defer_formatting(bool enable) noexcept {
+  global_state::deferred = enable;
+}
+
+
+
+bool logcerr::defer_formatting() noexcept {
+  return global_state::deferred;
+}
@@ -0,0 +1,451 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/binary.hpp"
+#include "logcerr/sink.hpp"
+#include "src/output.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <tuple>
+#include <variant>
+
+
+
+// A binary log starts with magic, followed by the wall-clock time of the start
+// of the log in microseconds since the epoch as varint. Every record consists
+// of its kind, the length of its payload as varint, and the payload:
+//
+//   string_record: varint id, text
+//     Defines the string referred to by id. Ids are assigned in order,
+//     starting at 1.
+//
+//   entry_record:  varint time, severity, varint thread id, varint category
+//                  id (0 if none), varint format id, varint length of fields,
+//                  fields, arguments
+//     Every argument consists of its argument_tag, followed by a varint, or
+//     by the length of a string as varint and its text.
+//
+// Records of unknown kinds are skipped by readers. Output appended to an
+// existing log starts with another header, which resets the start time and the
+// string ids; no record kind may therefore equal the first byte of magic.
+
+namespace {
+  constexpr std::string_view magic{"LOGCERR\x01", 8};
+
+  constexpr char string_record{'s'};
+  constexpr char entry_record {'e'};
+
+  // A varint holds at most 64 bits in groups of 7.
+  constexpr size_t max_varint_bytes{10};
+
+  // Records larger than this are considered corrupt instead of being read.
+  constexpr uint64_t max_record_size{uint64_t{1} << 30U};
+
+  // Arguments exceeding this number are ignored when formatting a message.
+  constexpr size_t max_arguments{32};
+
+  thread_local std::string payload_buffer;
+
+
+
+  [[noreturn]] void corrupt() {
+    throw std::runtime_error{"corrupt binary log"};
+  }
+
+
+
+  [[nodiscard]] uint64_t take_varint(std::string_view& data) {
+    uint64_t value{0};
+
+    for (size_t i = 0; i < max_varint_bytes && i < data.size(); ++i) {
+      const auto byte = static_cast<unsigned char>(data[i]);
+      value |= static_cast<uint64_t>(byte & 0x7fU) << (7 * i);
+
+      if ((byte & 0x80U) == 0) {
+        data.remove_prefix(i + 1);
+        return value;
+      }
+    }
+
+    corrupt();
+  }
+
+
+
+  [[nodiscard]] std::string_view take_bytes(std::string_view& data, uint64_t length) {
+    if (length > data.size()) {
+      corrupt();
+    }
+
+    auto bytes = data.substr(0, length);
+    data.remove_prefix(length);
+    return bytes;
+  }
+
+
+
+  // Returns false at the end of input.
+  [[nodiscard]] bool read_varint(std::istream& input, uint64_t& value) {
+    value = 0;
+
+    for (size_t i = 0; i < max_varint_bytes; ++i) {
+      const auto byte = input.get();
+      if (byte == std::istream::traits_type::eof()) {
+        return false;
+      }
+
+      value |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+
+      if ((byte & 0x80) == 0) {
+        return true;
+      }
+    }
+
+    corrupt();
+  }
+}
+
+
+
+
+
+void logcerr::impl::append_varint(std::string& out, uint64_t value) {
+  while (value >= 0x80U) {
+    out.push_back(static_cast<char>((value & 0x7fU) | 0x80U));
+    value >>= 7U;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+
+
+void logcerr::impl::append_argument(std::string& out, argument_tag tag, uint64_t value) {
+  out.push_back(static_cast<char>(tag));
+  append_varint(out, value);
+}
+
+
+
+void logcerr::impl::append_argument(std::string& out, std::string_view text) {
+  out.push_back(static_cast<char>(argument_tag::string));
+  append_varint(out, text.size());
+  out.append(text);
+}
+
+
+
+
+
+uint64_t logcerr::impl::binary_encoder::intern(std::string& out, std::string_view text) {
+  if (auto it = ids.find(text); it != ids.end()) {
+    return it->second;
+  }
+
+  const uint64_t id{ids.size() + 1};
+  ids.emplace(text, id);
+
+  auto& payload = payload_buffer;
+  payload.clear();
+  append_varint(payload, id);
+  payload.append(text);
+
+  out.push_back(string_record);
+  append_varint(out, payload.size());
+  out.append(payload);
+
+  return id;
+}
+
+
+
+void logcerr::impl::binary_encoder::encode(
+    std::string&            out,
+    const entry_info&       info,
+    std::string_view        fields,
+    const deferred_message* deferred
+) {
+  if (!started) {
+    started = true;
+
+    out.append(magic);
+    append_varint(out, static_cast<uint64_t>(std::chrono::duration_cast<
+        std::chrono::microseconds>(wall_clock({}).time_since_epoch()).count()));
+  }
+
+  const bool portable = deferred != nullptr && deferred->portable();
+
+  const uint64_t thread  {intern(out, info.thread_name)};
+  const uint64_t category{info.category.empty() ? 0 : intern(out, info.category)};
+  const uint64_t format  {intern(out, portable ? deferred->format_string() : "{}")};
+
+  auto& payload = payload_buffer;
+  payload.clear();
+  append_varint(payload, static_cast<uint64_t>(info.time.count()));
+  payload.push_back(static_cast<char>(info.level));
+  append_varint(payload, thread);
+  append_varint(payload, category);
+  append_varint(payload, format);
+  append_varint(payload, fields.size());
+  payload.append(fields);
+
+  if (portable) {
+    deferred->append_arguments(payload);
+  } else {
+    append_argument(payload, info.message);
+  }
+
+  out.push_back(entry_record);
+  append_varint(out, payload.size());
+  out.append(payload);
+}
+
+
+
+
+
+logcerr::binary_reader::binary_reader(std::istream& in) :
+  input{&in}
+{
+  const auto first = input->get();
+  if (first == std::istream::traits_type::eof()) {
+    // nothing has been written yet
+    return;
+  }
+
+  if (first != magic.front() || !read_header()) {
+    throw std::runtime_error{"not a binary log"};
+  }
+}
+
+
+
+bool logcerr::binary_reader::read_header() {
+  std::array<char, magic.size() - 1> header{};
+  input->read(header.data(), header.size());
+
+  uint64_t start{0};
+  if (static_cast<size_t>(input->gcount()) != header.size()
+      || std::string_view{header.data(), header.size()} != magic.substr(1)
+      || !read_varint(*input, start)) {
+    return false;
+  }
+
+  // ids restart with every header
+  strings.clear();
+
+  origin = std::chrono::system_clock::time_point{
+    std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::microseconds{start})};
+
+  return true;
+}
+
+
+
+bool logcerr::binary_reader::read_record(char& kind) {
+  while (true) {
+    const auto first = input->get();
+    if (first == std::istream::traits_type::eof()) {
+      return false;
+    }
+
+    if (first != magic.front()) {
+      kind = static_cast<char>(first);
+      break;
+    }
+
+    // another sink has appended its output to the same file
+    if (!read_header()) {
+      corrupt();
+    }
+  }
+
+  uint64_t length{0};
+  if (!read_varint(*input, length) || length > max_record_size) {
+    corrupt();
+  }
+
+  record.resize(length);
+  input->read(record.data(), static_cast<std::streamsize>(length));
+
+  if (static_cast<uint64_t>(input->gcount()) != length) {
+    corrupt();
+  }
+
+  return true;
+}
+
+
+
+bool logcerr::binary_reader::next(binary_entry& entry) {
+  auto lookup = [this](uint64_t id) -> std::string_view {
+    if (id == 0 || id > strings.size()) {
+      corrupt();
+    }
+    return strings[id - 1];
+  };
+
+  char kind{};
+  while (read_record(kind)) {
+    std::string_view data{record};
+
+    if (kind == string_record) {
+      if (take_varint(data) != strings.size() + 1) {
+        corrupt();
+      }
+      strings.emplace_back(data);
+    } else if (kind == entry_record) {
+      entry.time = std::chrono::microseconds{take_varint(data)};
+
+      const auto level = static_cast<unsigned char>(take_bytes(data, 1).front());
+      if (level > static_cast<unsigned char>(severity::error)) {
+        corrupt();
+      }
+      entry.level = static_cast<severity>(level);
+
+      entry.thread_name = lookup(take_varint(data));
+
+      const uint64_t category{take_varint(data)};
+      entry.category = category == 0 ? std::string_view{} : lookup(category);
+
+      entry.format    = lookup(take_varint(data));
+      entry.fields    = take_bytes(data, take_varint(data));
+      entry.arguments = data;
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+
+
+
+namespace {
+  // An argument decoded from a binary log, formatted with the replacement field
+  // of the format string it is used in.
+  struct argument {
+    std::variant<int64_t, uint64_t, float, double, bool, char, std::string_view,
+                 const void*> value;
+  };
+
+
+
+  [[nodiscard]] argument take_argument(std::string_view& data) {
+    using logcerr::impl::argument_tag;
+
+    const auto tag = static_cast<argument_tag>(take_bytes(data, 1).front());
+
+    if (tag == argument_tag::string) {
+      return {take_bytes(data, take_varint(data))};
+    }
+
+    const uint64_t value{take_varint(data)};
+
+    switch (tag) {
+      case argument_tag::signed_integer:
+        return {static_cast<int64_t>(value >> 1U) ^ -static_cast<int64_t>(value & 1U)};
+      case argument_tag::unsigned_integer:
+        return {value};
+      case argument_tag::float_number:
+        return {std::bit_cast<float>(static_cast<uint32_t>(value))};
+      case argument_tag::double_number:
+        return {std::bit_cast<double>(value)};
+      case argument_tag::boolean:
+        return {value != 0};
+      case argument_tag::character:
+        return {static_cast<char>(value)};
+      case argument_tag::pointer:
+        return {std::bit_cast<const void*>(static_cast<uintptr_t>(value))};
+      default:
+        corrupt();
+    }
+  }
+}
+
+
+
+template<>
+struct logcerr::impl::format::formatter<argument> {
+  std::string_view spec;
+
+  constexpr auto parse(auto& ctx) {
+    auto it = ctx.begin();
+
+    for (size_t depth = 0; it != ctx.end() && (*it != '}' || depth > 0); ++it) {
+      if (*it == '{') {
+        ++depth;
+      } else if (*it == '}') {
+        --depth;
+      }
+    }
+
+    spec = std::string_view{ctx.begin(), it};
+    return it;
+  }
+
+  auto format(const argument& arg, auto& ctx) const {
+    std::string field{"{:"};
+    field.append(spec);
+    field.push_back('}');
+
+    return std::visit([&](const auto& value) {
+      return logcerr::impl::format::vformat_to(ctx.out(), field,
+                                               logcerr::impl::format::make_format_args(value));
+    }, arg.value);
+  }
+};
+
+
+
+
+
+std::string logcerr::format_message(const binary_entry& entry) {
+  std::array<argument, max_arguments> args{};
+
+  size_t count{0};
+  for (auto data = entry.arguments; !data.empty() && count < args.size(); ++count) {
+    args.at(count) = take_argument(data);
+  }
+
+  std::string out;
+
+  try {
+    std::apply([&](auto&... value) {
+      impl::format::vformat_to(std::back_inserter(out), entry.format,
+                               impl::format::make_format_args(value...));
+    }, args);
+  } catch (const std::runtime_error&) {
+    // format_error of both format libraries derives from std::runtime_error
+    out.assign(entry.format);
+    for (size_t i = 0; i < count; ++i) {
+      out.push_back(' ');
+      impl::format::format_to(std::back_inserter(out), "{}", args.at(i));
+    }
+  }
+
+  return out;
+}
+
+
+
+std::string logcerr::format_text(
+    const binary_entry&                   entry,
+    std::chrono::system_clock::time_point start,
+    time_format                           fmt,
+    bool                                  colored
+) {
+  const auto message = format_message(entry);
+  const entry_info info{entry.level, entry.time, entry.thread_name, entry.category, message,
+                        1, false};
+
+  std::string out;
+  impl::append_text(out, colored, info, entry.fields, fmt, start);
+  return out;
+}
@@ -0,0 +1,496 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/call_site.hpp"
+#include "src/output.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+
+
+
+namespace logcerr::impl {
+  // Combines 1-in-N sampling with a token bucket implemented as generic cell
+  // rate algorithm, which needs a single compare-and-swap per admitted entry.
+  class limiter {
+    public:
+      explicit limiter(const rate_limit& limit) {
+        configure(limit);
+      }
+
+
+
+      // May be called while other threads use this limiter.
+      void configure(const rate_limit& limit) noexcept {
+        const int64_t step{limit.per_second > 0 ?
+                             static_cast<int64_t>(micros_per_second / limit.per_second) : 0};
+
+        sample.store(std::max<size_t>(limit.sample, 1), std::memory_order_relaxed);
+        interval.store(step, std::memory_order_relaxed);
+        tolerance.store(step * static_cast<int64_t>(std::max<size_t>(limit.burst, 1) - 1),
+                        std::memory_order_relaxed);
+      }
+
+
+
+      [[nodiscard]] bool admit() noexcept {
+        const size_t every{sample.load(std::memory_order_relaxed)};
+        if (every > 1 && counter.fetch_add(1, std::memory_order_relaxed) % every != 0) {
+          return false;
+        }
+
+        const int64_t interval{this->interval.load(std::memory_order_relaxed)};
+        if (interval == 0) {
+          return true;
+        }
+
+        const int64_t tolerance{this->tolerance.load(std::memory_order_relaxed)};
+
+        const int64_t now{timestamp().count()};
+        int64_t       current{tat.load(std::memory_order_relaxed)};
+
+        while (true) {
+          const int64_t base{std::max(current, now)};
+          if (base - now > tolerance) {
+            suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+          }
+
+          if (tat.compare_exchange_weak(current, base + interval,
+                                        std::memory_order_relaxed)) {
+            return true;
+          }
+        }
+      }
+
+
+
+      [[nodiscard]] uint64_t take_suppressed() noexcept {
+        if (suppressed.load(std::memory_order_relaxed) == 0) {
+          return 0;
+        }
+        return suppressed.exchange(0, std::memory_order_relaxed);
+      }
+
+      void add_suppressed(uint64_t count) noexcept {
+        suppressed.fetch_add(count, std::memory_order_relaxed);
+      }
+
+
+
+    private:
+      static constexpr double micros_per_second{1e6};
+
+      std::atomic<size_t>   sample   {1};
+      std::atomic<int64_t>  interval {0};
+      std::atomic<int64_t>  tolerance{0};
+
+      std::atomic<uint64_t> counter   {0};
+      std::atomic<int64_t>  tat       {0};
+      std::atomic<uint64_t> suppressed{0};
+  };
+}
+
+
+
+
+
+namespace {
+  using logcerr::impl::glob_match;
+
+
+
+  struct rule {
+    std::string         pattern;
+    logcerr::site_state state;
+  };
+
+
+
+  struct limit_rule {
+    std::string             pattern;
+    logcerr::rate_limit     limit;
+    bool                    by_format;
+    logcerr::impl::limiter* shared;
+  };
+
+
+
+  [[nodiscard]] bool matches(std::string_view pattern, const logcerr::call_site& site) {
+    return glob_match(pattern, logcerr::format("{}:{}", site.file(), site.line()));
+  }
+
+
+
+  [[nodiscard]] bool matches(const limit_rule& rule, const logcerr::call_site& site) {
+    if (rule.by_format) {
+      return glob_match(rule.pattern, site.format());
+    }
+    return matches(rule.pattern, site);
+  }
+
+
+
+  [[nodiscard]] bool is_unlimited(const logcerr::rate_limit& limit) {
+    return limit.per_second <= 0 && limit.sample <= 1;
+  }
+}
+
+
+
+
+
+namespace logcerr::impl {
+  struct call_site_registry {
+    static inline std::mutex          mutex;
+    static inline logcerr::call_site* head{nullptr}; // guarded by mutex
+    static inline std::vector<rule>   rules;         // guarded by mutex
+
+    static inline std::vector<limit_rule> limit_rules; // guarded by mutex
+
+    // limiters are never destroyed while the process runs, since call sites
+    // may still use them after their limit has changed; shared limiters of
+    // removed rules are reused instead
+    static inline std::vector<std::unique_ptr<limiter>> limiters; // guarded by mutex
+    static inline std::vector<limiter*>                 retired;  // guarded by mutex
+
+
+
+    // requires mutex to be held
+    [[nodiscard]] static limiter* make_limiter_unguarded(const rate_limit& limit) {
+      if (retired.empty()) {
+        return limiters.emplace_back(std::make_unique<limiter>(limit)).get();
+      }
+
+      auto* reused = retired.back();
+      retired.pop_back();
+
+      reused->configure(limit);
+      return reused;
+    }
+
+    // requires mutex to be held
+    [[nodiscard]] static limiter* own_limiter_unguarded(logcerr::call_site& site,
+                                                        const rate_limit& limit) {
+      if (site.own_rate == nullptr) {
+        site.own_rate = limiters.emplace_back(std::make_unique<limiter>(limit)).get();
+      } else {
+        site.own_rate->configure(limit);
+      }
+      return site.own_rate;
+    }
+
+
+
+    // requires mutex to be held
+    // Entries suppressed by the previous limiter of site are carried over, so
+    // that they are still reported once the next entry is admitted.
+    static void limit_unguarded(logcerr::call_site& site, limiter* lim) {
+      auto* previous = site.rate.load();
+
+      if (previous != nullptr && previous != lim) {
+        if (const uint64_t pending{previous->take_suppressed()}; pending > 0) {
+          if (lim == nullptr) {
+            lim = own_limiter_unguarded(site, rate_limit{});
+          }
+          lim->add_suppressed(pending);
+        }
+      }
+
+      site.rate = lim;
+    }
+
+    // requires mutex to be held
+    static void limit_unguarded(logcerr::call_site& site, const rate_limit& limit) {
+      limit_unguarded(site, is_unlimited(limit) ? nullptr : own_limiter_unguarded(site, limit));
+    }
+
+    // requires mutex to be held
+    static void limit_unguarded(logcerr::call_site& site, const limit_rule& rule) {
+      if (rule.shared != nullptr) {
+        limit_unguarded(site, rule.shared);
+      } else {
+        limit_unguarded(site, rule.limit);
+      }
+    }
+
+
+
+    // requires mutex to be held
+    static void retire_unguarded(const limit_rule& rule) {
+      if (rule.shared != nullptr) {
+        retired.push_back(rule.shared);
+      }
+    }
+
+
+
+    // requires mutex to be held
+    static void update_unguarded(logcerr::call_site& site) {
+      switch (site.mode.load()) {
+        case site_state::enabled:
+          site.active = true;
+          break;
+        case site_state::disabled:
+          site.active = false;
+          break;
+        default:
+          site.active = is_outputted(site.lvl);
+          break;
+      }
+    }
+
+
+
+    // requires mutex to be held
+    static void apply_rules_unguarded(logcerr::call_site& site) {
+      site.mode = site_state::inherit;
+
+      for (const auto& r: rules) {
+        if (matches(r.pattern, site)) {
+          site.mode = r.state;
+        }
+      }
+
+      update_unguarded(site);
+
+      for (auto it = limit_rules.rbegin(); it != limit_rules.rend(); ++it) {
+        if (matches(*it, site)) {
+          limit_unguarded(site, *it);
+          break;
+        }
+      }
+    }
+
+
+
+    // requires mutex to be held
+    static void assign_unguarded(logcerr::call_site& site, site_state state) {
+      site.mode = state;
+      update_unguarded(site);
+    }
+
+
+
+    // requires mutex to be held
+    template<typename Callback>
+    static void for_each_unguarded(Callback&& callback) {
+      for (auto* site = head; site != nullptr; site = site->next) {
+        callback(*site);
+      }
+    }
+
+
+
+    static void add(logcerr::call_site& site) {
+      const std::lock_guard<std::mutex> lock{mutex};
+
+      apply_rules_unguarded(site);
+
+      site.next = head;
+      head      = &site;
+    }
+  };
+}
+
+
+
+
+
+bool logcerr::impl::glob_match(std::string_view pattern, std::string_view text) {
+  size_t p{0};
+  size_t t{0};
+
+  size_t star     {std::string_view::npos};
+  size_t star_text{0};
+
+  while (t < text.size()) {
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t])) {
+      ++p;
+      ++t;
+    } else if (p < pattern.size() && pattern[p] == '*') {
+      star      = p++;
+      star_text = t;
+    } else if (star != std::string_view::npos) {
+      p = star + 1;
+      t = ++star_text;
+    } else {
+      return false;
+    }
+  }
+
+  while (p < pattern.size() && pattern[p] == '*') {
+    ++p;
+  }
+
+  return p == pattern.size();
+}
+
+
+
+
+
+logcerr::call_site::call_site(
+    severity         level,
+    std::string_view format,
+    std::string_view file,
+    unsigned int     line
+) :
+  lvl        {level},
+  fmt        {format},
+  file_name  {file},
+  line_number{line}
+{
+  impl::call_site_registry::add(*this);
+}
+
+
+
+void logcerr::call_site::limit(const rate_limit& value) {
+  const std::lock_guard<std::mutex> lock{impl::call_site_registry::mutex};
+
+  impl::call_site_registry::limit_unguarded(*this, value);
+}
+
+
+
+bool logcerr::impl::admit(const call_site& site, limiter& lim) noexcept {
+  if (!lim.admit()) {
+    return false;
+  }
+
+  if (auto suppressed = lim.take_suppressed(); suppressed > 0) {
+    try {
+      print(site.level(), logcerr::format("rate limit suppressed {} messages from {}:{}",
+                                          suppressed, site.file(), site.line()));
+    } catch (...) {
+      // the entry itself may still be printed
+    }
+  }
+
+  return true;
+}
+
+
+
+void logcerr::call_site::state(site_state value) {
+  const std::lock_guard<std::mutex> lock{impl::call_site_registry::mutex};
+
+  impl::call_site_registry::assign_unguarded(*this, value);
+}
+
+
+
+
+
+void logcerr::impl::update_call_sites() {
+  const std::lock_guard<std::mutex> lock{call_site_registry::mutex};
+
+  call_site_registry::for_each_unguarded(call_site_registry::update_unguarded);
+}
+
+
+
+void logcerr::call_site_state(std::string_view pattern, site_state state) {
+  using impl::call_site_registry;
+
+  const std::lock_guard<std::mutex> lock{call_site_registry::mutex};
+
+  call_site_registry::rules.emplace_back(std::string{pattern}, state);
+
+  call_site_registry::for_each_unguarded([&](call_site& site) {
+    if (matches(pattern, site)) {
+      call_site_registry::assign_unguarded(site, state);
+    }
+  });
+}
+
+
+
+namespace {
+  void add_limit_rule(std::string_view pattern, const logcerr::rate_limit& limit,
+                      bool by_format) {
+    using logcerr::impl::call_site_registry;
+
+    const std::lock_guard<std::mutex> lock{call_site_registry::mutex};
+
+    auto& rules = call_site_registry::limit_rules;
+
+    // a rule with the same pattern is replaced, so that reconfiguring does not
+    // accumulate rules and limiters
+    if (auto it = std::ranges::find_if(rules, [&](const limit_rule& rule) {
+          return rule.by_format == by_format && rule.pattern == pattern;
+        }); it != rules.end()) {
+      call_site_registry::retire_unguarded(*it);
+      rules.erase(it);
+    }
+
+    auto& added = rules.emplace_back(std::string{pattern}, limit, by_format,
+      by_format && !is_unlimited(limit) ? call_site_registry::make_limiter_unguarded(limit)
+                                        : nullptr);
+
+    call_site_registry::for_each_unguarded([&](logcerr::call_site& site) {
+      if (matches(added, site)) {
+        call_site_registry::limit_unguarded(site, added);
+      }
+    });
+  }
+}
+
+
+
+void logcerr::call_site_limit(std::string_view pattern, const rate_limit& limit) {
+  add_limit_rule(pattern, limit, false);
+}
+
+
+
+void logcerr::format_limit(std::string_view pattern, const rate_limit& limit) {
+  add_limit_rule(pattern, limit, true);
+}
+
+
+
+void logcerr::reset_call_sites() {
+  using impl::call_site_registry;
+
+  const std::lock_guard<std::mutex> lock{call_site_registry::mutex};
+
+  call_site_registry::rules.clear();
+
+  for (const auto& rule: call_site_registry::limit_rules) {
+    call_site_registry::retire_unguarded(rule);
+  }
+  call_site_registry::limit_rules.clear();
+
+  call_site_registry::for_each_unguarded([](call_site& site) {
+    call_site_registry::assign_unguarded(site, site_state::inherit);
+    call_site_registry::limit_unguarded(site, nullptr);
+  });
+}
+
+
+
+void logcerr::for_each_call_site(const std::function<void(call_site&)>& callback) {
+  using impl::call_site_registry;
+
+  std::vector<call_site*> sites;
+  {
+    const std::lock_guard<std::mutex> lock{call_site_registry::mutex};
+
+    call_site_registry::for_each_unguarded([&](call_site& site) {
+      sites.emplace_back(&site);
+    });
+  }
+
+  for (auto* site: sites) {
+    callback(*site);
+  }
+}
@@ -0,0 +1,181 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/category.hpp"
+#include "src/output.hpp"
+
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+
+
+
+
+namespace {
+  struct level_rule {
+    std::string       pattern;
+    logcerr::severity level;
+  };
+}
+
+
+
+
+
+namespace logcerr::impl {
+  struct category_registry {
+    static inline std::mutex              mutex;
+    static inline logcerr::category*      head{nullptr}; // guarded by mutex
+    static inline std::vector<level_rule> rules;         // guarded by mutex
+
+
+
+    // Names are referenced by entries which may be written after their
+    // category has been destroyed, even during static destruction, hence they
+    // are never freed.
+    // requires mutex to be held
+    [[nodiscard]] static std::string_view intern_unguarded(std::string_view name) {
+      //NOLINTNEXTLINE(*-owning-memory)
+      static auto* names = new std::set<std::string, std::less<>>;
+
+      if (auto it = names->find(name); it != names->end()) {
+        return *it;
+      }
+      return *names->emplace(name).first;
+    }
+
+
+
+    [[nodiscard]] static bool matches(std::string_view pattern, const logcerr::category& cat) {
+      return glob_match(pattern, cat.label);
+    }
+
+
+
+    // requires mutex to be held
+    static void assign_unguarded(logcerr::category& cat, severity level) {
+      cat.threshold.store(level, std::memory_order_relaxed);
+      cat.overridden = true;
+    }
+
+    // requires mutex to be held
+    static void inherit_unguarded(logcerr::category& cat) {
+      if (!cat.overridden) {
+        cat.threshold.store(output_level(), std::memory_order_relaxed);
+      }
+    }
+
+
+
+    // requires mutex to be held
+    static void apply_rules_unguarded(logcerr::category& cat) {
+      cat.overridden = false;
+
+      for (auto it = rules.rbegin(); it != rules.rend(); ++it) {
+        if (matches(it->pattern, cat)) {
+          assign_unguarded(cat, it->level);
+          return;
+        }
+      }
+
+      inherit_unguarded(cat);
+    }
+
+
+
+    // requires mutex to be held
+    template<typename Callback>
+    static void for_each_unguarded(Callback&& callback) {
+      for (auto* cat = head; cat != nullptr; cat = cat->next) {
+        callback(*cat);
+      }
+    }
+
+
+
+    static void add(logcerr::category& cat, std::string_view name) {
+      const std::lock_guard<std::mutex> lock{mutex};
+
+      cat.label = intern_unguarded(name);
+      apply_rules_unguarded(cat);
+
+      cat.next = head;
+      if (head != nullptr) {
+        head->previous = &cat;
+      }
+      head = &cat;
+    }
+
+
+
+    // Categories are kept in an intrusive list, so that categories with
+    // static storage duration can be removed during static destruction.
+    static void remove(logcerr::category& cat) {
+      const std::lock_guard<std::mutex> lock{mutex};
+
+      if (cat.previous != nullptr) {
+        cat.previous->next = cat.next;
+      } else {
+        head = cat.next;
+      }
+
+      if (cat.next != nullptr) {
+        cat.next->previous = cat.previous;
+      }
+    }
+  };
+}
+
+
+
+
+
+logcerr::category::category(std::string_view name) {
+  impl::category_registry::add(*this, name);
+}
+
+
+
+logcerr::category::~category() {
+  impl::category_registry::remove(*this);
+}
+
+
+
+
+
+void logcerr::impl::update_categories() {
+  const std::lock_guard<std::mutex> lock{category_registry::mutex};
+
+  category_registry::for_each_unguarded(category_registry::inherit_unguarded);
+}
+
+
+
+void logcerr::category_level(std::string_view pattern, severity lowest_level) {
+  using impl::category_registry;
+
+  const std::lock_guard<std::mutex> lock{category_registry::mutex};
+
+  category_registry::rules.emplace_back(std::string{pattern}, lowest_level);
+
+  category_registry::for_each_unguarded([&](category& cat) {
+    if (category_registry::matches(pattern, cat)) {
+      category_registry::assign_unguarded(cat, lowest_level);
+    }
+  });
+}
+
+
+
+void logcerr::reset_category_levels() {
+  using impl::category_registry;
+
+  const std::lock_guard<std::mutex> lock{category_registry::mutex};
+
+  category_registry::rules.clear();
+
+  category_registry::for_each_unguarded(category_registry::apply_rules_unguarded);
+}
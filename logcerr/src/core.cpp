@@ -2,15 +2,16 @@
 // SPDX-License-Identifier: MIT
 
 #include "logcerr/log.hpp"
+#include "src/output.hpp"
 
-#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <memory>
 #include <mutex>
-#include <optional>
 #include <ratio>
 #include <sstream>
-#include <vector>
+#include <unordered_map>
 
 #include <unistd.h>
 
@@ -39,6 +40,21 @@ namespace {
   >::clock;
 
   static_assert(clock::is_steady);
+
+
+
+  struct name_slot {
+    explicit name_slot(std::string_view name, bool attached = false) :
+      name    {std::make_shared<const std::string>(name)},
+      attached{attached}
+    {}
+
+    std::atomic<size_t>        version{0};
+    logcerr::impl::shared_name name;     // guarded by thread_names_mutex
+    bool                       attached; // guarded by thread_names_mutex
+  };
+
+  using name_registry = std::unordered_map<std::thread::id, std::shared_ptr<name_slot>>;
 }
 
 
@@ -55,9 +71,21 @@ namespace { namespace global_state {
 
   std::atomic<size_t>              merge  {2};
 
+  std::atomic<logcerr::time_format> time_format{logcerr::time_format::elapsed};
+
+  std::atomic<logcerr::control_policy> control{logcerr::control_policy::keep};
+
+  // offset of the system clock relative to start in microseconds
+  std::atomic<int64_t>             wall_offset{
+    std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count()
+  };
+  std::atomic<int64_t>             wall_synced{0};
+
   std::mutex                       thread_names_mutex;
-  std::vector<std::thread::id>     thread_ids  {std::this_thread::get_id()};
-  std::vector<std::string>         thread_names{"main"};
+  name_registry                    thread_names{
+    {std::this_thread::get_id(), std::make_shared<name_slot>("main", true)}
+  };
 }}
 
 
@@ -73,15 +101,75 @@ namespace {
 
 
 
-  [[nodiscard]] std::optional<size_t> find_thread_index_unguarded(std::thread::id t_id)
-  {
-    auto iter = std::ranges::find(global_state::thread_ids, t_id);
-    if (iter == global_state::thread_ids.end()) {
-      return {};
+  [[nodiscard]] std::shared_ptr<name_slot> find_slot_unguarded(std::thread::id t_id) {
+    if (auto iter = global_state::thread_names.find(t_id);
+        iter != global_state::thread_names.end()) {
+      return iter->second;
     }
 
-    return iter - global_state::thread_ids.begin();
+    return {};
   }
+
+
+
+  // Caches the name of the current thread. The registry entry of a thread is
+  // removed once the thread exits; renaming only bumps the version of a slot,
+  // which is the only value read on the hot path.
+  // Slots without a cache attached belong to threads which have not logged yet
+  // or have already exited. Since thread ids are reused, they are replaced once
+  // a new thread registers with the same id.
+  class thread_name_cache {
+    public:
+      thread_name_cache(const thread_name_cache&) = delete;
+      thread_name_cache(thread_name_cache&&)      = delete;
+      thread_name_cache& operator=(const thread_name_cache&) = delete;
+      thread_name_cache& operator=(thread_name_cache&&)      = delete;
+
+      thread_name_cache() {
+        const std::lock_guard<std::mutex> lock{global_state::thread_names_mutex};
+
+        auto& registered = global_state::thread_names[id];
+        if (!registered || !registered->attached) {
+          registered = std::make_shared<name_slot>(to_string(id), true);
+        }
+
+        slot    = registered;
+        name    = slot->name;
+        version = slot->version.load(std::memory_order_relaxed);
+      }
+
+      ~thread_name_cache() {
+        const std::lock_guard<std::mutex> lock{global_state::thread_names_mutex};
+
+        if (auto iter = global_state::thread_names.find(id);
+            iter != global_state::thread_names.end() && iter->second == slot) {
+          global_state::thread_names.erase(iter);
+        }
+      }
+
+
+
+      [[nodiscard]] const logcerr::impl::shared_name& get() {
+        if (slot->version.load(std::memory_order_acquire) != version) {
+          const std::lock_guard<std::mutex> lock{global_state::thread_names_mutex};
+
+          name    = slot->name;
+          version = slot->version.load(std::memory_order_relaxed);
+        }
+
+        return name;
+      }
+
+
+
+    private:
+      std::thread::id            id{std::this_thread::get_id()};
+      std::shared_ptr<name_slot> slot;
+      logcerr::impl::shared_name name;
+      size_t                     version{0};
+  };
+
+  thread_local thread_name_cache current_thread;
 }
 
 
@@ -119,6 +207,8 @@ logcerr::color_mode logcerr::colorize() noexcept {
 
 void logcerr::output_level(severity lowest_level) noexcept {
   global_state::level = lowest_level;
+  impl::update_call_sites();
+  impl::update_categories();
 }
 
 logcerr::severity logcerr::output_level() noexcept {
@@ -147,30 +237,44 @@ size_t logcerr::merge_after() noexcept {
 
 
 void logcerr::thread_name(std::string_view name, std::thread::id thread_id) {
+  if (thread_id == std::this_thread::get_id()) {
+    // registers the current thread such that its entry is removed on exit
+    static_cast<void>(current_thread.get());
+  }
+
+  auto value = std::make_shared<const std::string>(name);
+
   const std::lock_guard<std::mutex> lock{global_state::thread_names_mutex};
 
-  if (auto index = find_thread_index_unguarded(thread_id)) {
-    global_state::thread_names[*index] = name;
+  if (auto slot = find_slot_unguarded(thread_id)) {
+    slot->name = std::move(value);
+    slot->version.fetch_add(1, std::memory_order_release);
 
   } else {
-    global_state::thread_names.emplace_back(name);
-    global_state::thread_ids.emplace_back(thread_id);
+    global_state::thread_names.emplace(thread_id, std::make_shared<name_slot>(name));
   }
 }
 
 
 
 std::string logcerr::thread_name(std::thread::id thread_id) {
+  if (thread_id == std::this_thread::get_id()) {
+    return *current_thread.get();
+  }
+
   const std::lock_guard<std::mutex> lock{global_state::thread_names_mutex};
 
-  if (auto index = find_thread_index_unguarded(thread_id)) {
-    return global_state::thread_names[*index];
+  if (auto slot = find_slot_unguarded(thread_id)) {
+    return *slot->name;
   }
 
-  global_state::thread_names.emplace_back(to_string(thread_id));
-  global_state::thread_ids.emplace_back(thread_id);
+  return to_string(thread_id);
+}
+
 
-  return global_state::thread_names.back();
+
+logcerr::impl::shared_name logcerr::impl::current_thread_name() {
+  return current_thread.get();
 }
 
 
@@ -181,3 +285,72 @@ std::chrono::milliseconds logcerr::elapsed() {
   return std::chrono::duration_cast<std::chrono::milliseconds>(
       clock::now() - global_state::start);
 }
+
+
+
+std::chrono::microseconds logcerr::impl::timestamp() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      clock::now() - global_state::start);
+}
+
+
+
+std::chrono::system_clock::time_point logcerr::impl::wall_clock(
+    std::chrono::microseconds time
+) {
+  static constexpr int64_t resync_us{10'000'000};
+
+  if (time.count() - global_state::wall_synced.load(std::memory_order_relaxed) > resync_us) {
+    const auto now  = timestamp();
+    const auto wall = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch());
+
+    global_state::wall_offset.store((wall - now).count(), std::memory_order_relaxed);
+    global_state::wall_synced.store(now.count(), std::memory_order_relaxed);
+  }
+
+  return std::chrono::system_clock::time_point{std::chrono::duration_cast<
+    std::chrono::system_clock::duration>(std::chrono::microseconds{
+        time.count() + global_state::wall_offset.load(std::memory_order_relaxed)})};
+}
+
+
+
+
+
+void logcerr::timestamp_format(time_format format) {
+  switch (format) {
+    case time_format::elapsed:
+    case time_format::elapsed_micro:
+    case time_format::utc:
+    case time_format::utc_micro:
+      global_state::time_format = format;
+      break;
+    default:
+      throw std::invalid_argument{"expected a valid time format"};
+  }
+}
+
+logcerr::time_format logcerr::timestamp_format() noexcept {
+  return global_state::time_format.load(std::memory_order_relaxed);
+}
+
+
+
+
+
+void logcerr::sanitize(control_policy policy) {
+  switch (policy) {
+    case control_policy::keep:
+    case control_policy::escape:
+    case control_policy::strip:
+      global_state::control = policy;
+      break;
+    default:
+      throw std::invalid_argument{"expected a valid control policy"};
+  }
+}
+
+logcerr::control_policy logcerr::sanitize() noexcept {
+  return global_state::control.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,225 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/log.hpp"
+#include "logcerr/sink.hpp"
+#include "src/output.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+
+
+
+namespace {
+  using logcerr::impl::field_kind;
+
+
+
+  [[nodiscard]] uint32_t read_size(std::string_view data, size_t offset) {
+    uint32_t size{};
+    std::memcpy(&size, data.data() + offset, sizeof(size));
+    return size;
+  }
+
+
+
+  // Invokes callback(key, kind, value) for every field serialized by
+  // impl::field_list.
+  template<typename Callback>
+  void for_each_field(std::string_view fields, Callback&& callback) {
+    while (!fields.empty()) {
+      const uint32_t key_length{read_size(fields, 0)};
+      auto key = fields.substr(sizeof(uint32_t), key_length);
+      fields.remove_prefix(sizeof(uint32_t) + key_length);
+
+      auto kind = static_cast<field_kind>(fields.front());
+      fields.remove_prefix(1);
+
+      const uint32_t value_length{read_size(fields, 0)};
+      auto value = fields.substr(sizeof(uint32_t), value_length);
+      fields.remove_prefix(sizeof(uint32_t) + value_length);
+
+      callback(key, kind, value);
+    }
+  }
+
+
+
+  constexpr std::array<char, 16> hex_digits{
+    '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+  };
+
+  // Escapes text according to the rules of JSON strings, which are also
+  // understood by logfmt parsers.
+  void append_escaped(std::string& out, std::string_view text) {
+    for (char c: text) {
+      switch (c) {
+        case '"':  out.append("\\\""); break;
+        case '\\': out.append("\\\\"); break;
+        case '\n': out.append("\\n");  break;
+        case '\r': out.append("\\r");  break;
+        case '\t': out.append("\\t");  break;
+        default:
+          if (static_cast<unsigned char>(c) < 0x20) {
+            out.append("\\u00");
+            out.push_back(hex_digits.at(static_cast<unsigned char>(c) >> 4));
+            out.push_back(hex_digits.at(static_cast<unsigned char>(c) & 0xf));
+          } else {
+            out.push_back(c);
+          }
+          break;
+      }
+    }
+  }
+
+
+
+  void append_quoted(std::string& out, std::string_view text) {
+    out.push_back('"');
+    append_escaped(out, text);
+    out.push_back('"');
+  }
+
+
+
+  [[nodiscard]] bool needs_quotes(std::string_view value) {
+    if (value.empty()) {
+      return true;
+    }
+
+    for (char c: value) {
+      if (c == ' ' || c == '=' || c == '"' || static_cast<unsigned char>(c) < 0x20) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void append_logfmt_value(std::string& out, std::string_view value) {
+    if (!needs_quotes(value)) {
+      out.append(value);
+      return;
+    }
+
+    append_quoted(out, value);
+  }
+
+  void append_logfmt_key(std::string& out, std::string_view key) {
+    for (char c: key) {
+      out.push_back(c == ' ' || c == '=' || c == '"' ? '_' : c);
+    }
+  }
+
+
+
+  void append_count(std::string& out, size_t count) {
+    std::array<char, 24> buffer{};
+    auto result = logcerr::impl::format::format_to_n(buffer.begin(), buffer.size(),
+                                                     "{}", count);
+    out.append(buffer.data(), static_cast<size_t>(result.out - buffer.begin()));
+  }
+}
+
+
+
+
+
+std::string_view logcerr::impl::severity_name(severity level) {
+  switch (level) {
+    case severity::debug:   return "debug";
+    case severity::verbose: return "verbose";
+    case severity::log:     return "log";
+    case severity::warning: return "warning";
+    case severity::error:   return "error";
+  }
+  return "unknown";
+}
+
+
+
+void logcerr::impl::append_fields_text(std::string& out, std::string_view fields) {
+  for_each_field(fields, [&](std::string_view key, field_kind /*kind*/,
+                             std::string_view value) {
+    out.push_back(' ');
+    append_logfmt_key(out, key);
+    out.push_back('=');
+    append_logfmt_value(out, value);
+  });
+}
+
+
+
+void logcerr::impl::encode_json(
+    std::string&      out,
+    const entry_info& info,
+    std::string_view  time,
+    std::string_view  fields
+) {
+  out.append("{\"time\":");
+  append_quoted(out, time);
+  out.append(",\"level\":\"");
+  out.append(severity_name(info.level));
+  out.append("\",\"thread\":");
+  append_quoted(out, info.thread_name);
+  if (!info.category.empty()) {
+    out.append(",\"category\":");
+    append_quoted(out, info.category);
+  }
+  out.append(",\"message\":");
+  append_quoted(out, info.message);
+
+  if (info.count > 1) {
+    out.append(",\"count\":");
+    append_count(out, info.count);
+  }
+
+  for_each_field(fields, [&](std::string_view key, field_kind kind,
+                             std::string_view value) {
+    out.push_back(',');
+    append_quoted(out, key);
+    out.push_back(':');
+
+    if (kind == field_kind::string) {
+      append_quoted(out, value);
+    } else {
+      out.append(value);
+    }
+  });
+
+  out.append("}\n");
+}
+
+
+
+void logcerr::impl::encode_logfmt(
+    std::string&      out,
+    const entry_info& info,
+    std::string_view  time,
+    std::string_view  fields
+) {
+  out.append("time=");
+  append_logfmt_value(out, time);
+  out.append(" level=");
+  out.append(severity_name(info.level));
+  out.append(" thread=");
+  append_logfmt_value(out, info.thread_name);
+  if (!info.category.empty()) {
+    out.append(" category=");
+    append_logfmt_value(out, info.category);
+  }
+  out.append(" msg=");
+  append_logfmt_value(out, info.message);
+
+  if (info.count > 1) {
+    out.append(" count=");
+    append_count(out, info.count);
+  }
+
+  append_fields_text(out, fields);
+
+  out.push_back('\n');
+}
@@ -2,12 +2,22 @@
 // SPDX-License-Identifier: MIT
 
 #include "logcerr/log.hpp"
-
+#include "logcerr/mapped_log.hpp"
+#include "logcerr/sink.hpp"
+#include "src/output.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <chrono>
-#include <iostream>
+#include <functional>
+#include <iterator>
 #include <mutex>
 #include <optional>
+#include <ostream>
 #include <span>
+#include <stdexcept>
 #include <vector>
 
 
@@ -17,23 +27,7 @@
 namespace { namespace global_state {
   std::mutex output_mutex;
 
-  bool       last_message_returned{false}; // guarded by output_mutex
-
-
-
-  class terminator_t {
-    public:
-      terminator_t(const terminator_t&) = delete;
-      terminator_t(terminator_t&&)      = delete;
-      terminator_t& operator=(const terminator_t&) = delete;
-      terminator_t& operator=(terminator_t&&)      = delete;
-
-      terminator_t() = default;
-
-      ~terminator_t() {
-        logcerr::interrupt_merging();
-      }
-  } terminator;
+  std::atomic<size_t> preallocated{0};
 }}
 
 
@@ -41,29 +35,32 @@ namespace { namespace global_state {
 
 
 namespace {
-  [[nodiscard]] std::vector<std::string_view> split(std::string_view input) {
-    if (input.empty()) {
-      return {input};
-    }
+  // Splits input into lines, reusing the capacity of output and storage.
+  void split(
+      std::vector<std::string_view>& output,
+      std::string&                   storage,
+      std::string_view               input
+  ) {
+    logcerr::impl::split_lines(output, storage, input, logcerr::sanitize());
+  }
 
-    std::vector<std::string_view> output;
 
-    while (true) {
-      auto pos = input.find('\n');
-      output.emplace_back(input.substr(0, pos));
 
-      if (pos == std::string_view::npos) {
-        break;
-      }
+  [[nodiscard]] size_t fingerprint(
+      logcerr::severity level,
+      std::string_view  message,
+      std::string_view  fields
+  ) {
+    static constexpr size_t golden{0x9e3779b97f4a7c15};
 
-      input.remove_prefix(pos + 1);
-    }
+    auto hash = std::hash<std::string_view>{}(message)
+      ^ (static_cast<size_t>(level) + 1) * golden;
 
-    while (output.size() > 1 && output.back().empty()) {
-      output.pop_back();
+    if (!fields.empty()) {
+      hash ^= std::hash<std::string_view>{}(fields) << 1U;
     }
 
-    return output;
+    return hash;
   }
 
 
@@ -77,27 +74,58 @@ namespace {
 
 
 
+  // Unless interrupted by a signal, a full device, or buffering, an entry is
+  // written in a single call, so that other processes sharing the pipe (up to
+  // PIPE_BUF bytes) or O_APPEND file cannot interleave with it.
+  using output_buffer = std::string;
+
+  // Entries are assembled here before being written with a single call, one
+  // buffer per variant (see sink_slot::variant). Clearing keeps the capacity,
+  // so that the buffers are allocated only once.
+  constexpr size_t variant_count{4};
+
+  thread_local std::array<output_buffer, variant_count> entry_buffers;
+
+  thread_local output_buffer suffix_buffer;
+  thread_local output_buffer label_buffer;
 
+  thread_local std::vector<std::string_view> line_buffer;
+  thread_local output_buffer                 line_storage;
 
-  [[nodiscard]] std::string format_extra(
+
+
+  template<typename... Args>
+  void append(output_buffer& out, logcerr::format_string<Args...> fmt, Args&&... args) {
+    logcerr::impl::format::format_to(std::back_inserter(out), std::move(fmt),
+                                     std::forward<Args>(args)...);
+  }
+
+
+
+
+
+  void format_extra(
+      output_buffer&    out,
       bool              use_color,
       logcerr::severity level,
       std::string_view  message,
       std::string_view  terminal
   ) {
-    using namespace logcerr::impl::format;
-
     if (!use_color) {
-      return format("\r  | {}", message);
+      append(out, "\r  | {}{}", message, terminal);
+      return;
     }
 
     switch (level) {
       case logcerr::severity::error:
-        return format("\r  \x1b[2m|\x1b[0m \x1b[1m{}{}\x1b[0m", message, terminal);
+        append(out, "\r  \x1b[2m|\x1b[0m \x1b[1m{}{}\x1b[0m", message, terminal);
+        break;
       case logcerr::severity::debug:
-        return format("\r  \x1b[2m| {}{}\x1b[0m", message, terminal);
+        append(out, "\r  \x1b[2m| {}{}\x1b[0m", message, terminal);
+        break;
       default:
-        return format("\r  \x1b[2m|\x1b[0m {}{}", message, terminal);
+        append(out, "\r  \x1b[2m|\x1b[0m {}{}", message, terminal);
+        break;
     }
   }
 
@@ -105,95 +133,256 @@ namespace {
 
 
 
-  [[nodiscard]] std::array<long, 4> h_min_sec_ms(std::chrono::milliseconds time) {
-    const long millis{time.count()};
+  // Formats timestamps, reusing the previous result for as long as the
+  // displayed value does not change.
+  class time_cache {
+    public:
+      [[nodiscard]] std::string_view get(
+          std::chrono::microseconds time,
+          logcerr::time_format      fmt
+      ) {
+        const auto key = is_micro(fmt) ? time.count() : time.count() / micros_per_milli;
+
+        if (key != cached_key || fmt != cached_format) {
+          length        = render(time, fmt, {});
+          cached_key    = key;
+          cached_format = fmt;
+        }
 
-    static constexpr long minute_s{60};
-    static constexpr long hour_min{60};
-    static constexpr long second_ms{1000};
+        return {text.data(), length};
+      }
 
-    static constexpr long minute_ms{minute_s * second_ms};
-    static constexpr long hour_ms  {hour_min * minute_ms};
 
-    return {
-      (millis / hour_ms),
-      (millis / minute_ms) % hour_min,
-      (millis / second_ms) % minute_s,
-      millis               % second_ms
-    };
-  }
 
+      // Formats time of a log started at the wall-clock time start, which may
+      // have been written by another process.
+      [[nodiscard]] std::string_view get(
+          std::chrono::microseconds             time,
+          logcerr::time_format                  fmt,
+          std::chrono::system_clock::time_point start
+      ) {
+        length     = render(time, fmt, start + time);
+        cached_key = -1;
+
+        return {text.data(), length};
+      }
+
+
+
+    private:
+      static constexpr long micros_per_milli{1000};
+      static constexpr long micros_per_second{1000 * micros_per_milli};
+      static constexpr long micros_per_minute{60 * micros_per_second};
+      static constexpr long micros_per_hour  {60 * micros_per_minute};
+
+      std::chrono::microseconds::rep cached_key{-1};
+      logcerr::time_format           cached_format{logcerr::time_format::elapsed};
+
+      std::array<char, 48> text{};
+      size_t               length{0};
+
+
+
+      [[nodiscard]] static bool is_micro(logcerr::time_format fmt) {
+        return fmt == logcerr::time_format::elapsed_micro
+            || fmt == logcerr::time_format::utc_micro;
+      }
+
+
+
+      template<typename... Args>
+      [[nodiscard]] size_t render_to(logcerr::format_string<Args...> fmt, Args&&... args) {
+        auto result = logcerr::impl::format::format_to_n(text.begin(), text.size(),
+            std::move(fmt), std::forward<Args>(args)...);
+        return std::min(text.size(), static_cast<size_t>(result.size));
+      }
 
 
-  [[nodiscard]] std::string format_main(
-      bool                      use_color,
-      logcerr::severity         level,
-      std::chrono::milliseconds time,
-      std::string_view          thread,
-      std::string_view          message,
-      std::string_view          terminal
-  ) {
-    using namespace logcerr::impl::format;
 
-    const auto [h, m, s, ms] = h_min_sec_ms(time);
+      // wall is the wall-clock time of time if known.
+      [[nodiscard]] size_t render(
+          std::chrono::microseconds                            time,
+          logcerr::time_format                                 fmt,
+          std::optional<std::chrono::system_clock::time_point> wall
+      ) {
+        const bool micro = is_micro(fmt);
 
+        if (fmt == logcerr::time_format::utc || fmt == logcerr::time_format::utc_micro) {
+          return render_utc(wall ? *wall : logcerr::impl::wall_clock(time), micro);
+        }
+
+        const long micros{time.count()};
+
+        const long h{micros / micros_per_hour};
+        const long m{(micros / micros_per_minute) % 60};
+        const long s{(micros / micros_per_second) % 60};
+        const long f{micros % micros_per_second};
+
+        if (micro) {
+          return render_to("{:02}:{:02}:{:02}.{:06}", h, m, s, f);
+        }
+        return render_to("{:02}:{:02}:{:02}.{:03}", h, m, s, f / micros_per_milli);
+      }
+
+
+
+      [[nodiscard]] size_t render_utc(std::chrono::system_clock::time_point time, bool micro) {
+        using namespace std::chrono;
+
+        const auto day = floor<days>(time);
+        const year_month_day date{day};
+        const hh_mm_ss clock{floor<microseconds>(time - day)};
+
+        const int      y {static_cast<int>(date.year())};
+        const unsigned mo{static_cast<unsigned>(date.month())};
+        const unsigned d {static_cast<unsigned>(date.day())};
+        const long     h {clock.hours().count()};
+        const long     mi{clock.minutes().count()};
+        const long     s {clock.seconds().count()};
+        const long     f {clock.subseconds().count()};
+
+        if (micro) {
+          return render_to("{:04}-{:02}-{:02}T{:02}:{:02}:{:02}.{:06}Z",
+                           y, mo, d, h, mi, s, f);
+        }
+        return render_to("{:04}-{:02}-{:02}T{:02}:{:02}:{:02}.{:03}Z",
+                         y, mo, d, h, mi, s, f / micros_per_milli);
+      }
+  };
+
+  thread_local time_cache timestamps;
+
+
+
+  void format_main(
+      output_buffer&    out,
+      bool              use_color,
+      logcerr::severity level,
+      std::string_view  time,
+      std::string_view  thread,
+      std::string_view  message,
+      std::string_view  terminal
+  ) {
     if (!use_color) {
       switch (level) {
         case logcerr::severity::warning:
-          return format("\r[{:02}:{:02}:{:02}.{:03} {}] [Warning] {}{}",
-                          h, m, s, ms, thread, message, terminal);
+          append(out, "\r[{} {}] [Warning] {}{}",
+                   time, thread, message, terminal);
+          return;
 
         case logcerr::severity::error:
-          return format("\r[{:02}:{:02}:{:02}.{:03} {}] *[Error]* {}{}",
-                          h, m, s, ms, thread, message, terminal);
+          append(out, "\r[{} {}] *[Error]* {}{}",
+                   time, thread, message, terminal);
+          return;
 
         default:
-          return format("\r[{:02}:{:02}:{:02}.{:03} {}] {}{}",
-                          h, m, s, ms, thread, message, terminal);
+          append(out, "\r[{} {}] {}{}",
+                   time, thread, message, terminal);
+          return;
       }
     }
 
 
     switch (level) {
       case logcerr::severity::debug:
-        return format("\r\x1b[2m[{:02}:{:02}:{:02}.{:03} {}] {}{}\x1b[0m",
-                        h, m, s, ms, thread, message, terminal);
+        append(out, "\r\x1b[2m[{} {}] {}{}\x1b[0m",
+                 time, thread, message, terminal);
+        return;
 
       case logcerr::severity::warning:
-        return format("\r[{:02}:{:02}:{:02}.{:03} {}] \x1b[33m[Warning]\x1b[0m {}{}",
-                        h, m, s, ms, thread, message, terminal);
+        append(out, "\r[{} {}] \x1b[33m[Warning]\x1b[0m {}{}",
+                 time, thread, message, terminal);
+        return;
 
       case logcerr::severity::error:
-        return format("\r\x1b[1m[{:02}:{:02}:{:02}.{:03} {}] "
-                        "\x1b[31m*[Error]*\x1b[39m {}{}\x1b[0m",
-                        h, m, s, ms, thread, message, terminal);
+        append(out, "\r\x1b[1m[{} {}] "
+                 "\x1b[31m*[Error]*\x1b[39m {}{}\x1b[0m",
+                 time, thread, message, terminal);
+        return;
 
       default:
-        return format("\r[{:02}:{:02}:{:02}.{:03} {}] {}{}",
-                        h, m, s, ms, thread, message, terminal);
+        append(out, "\r[{} {}] {}{}",
+                 time, thread, message, terminal);
+        return;
+    }
+  }
+
+
+
+
+
+  // Combines the text form of fields with the terminal of the last line.
+  [[nodiscard]] std::string_view with_fields(
+      std::string_view fields,
+      std::string_view terminal
+  ) {
+    if (fields.empty()) {
+      return terminal;
     }
+
+    suffix_buffer.clear();
+    logcerr::impl::append_fields_text(suffix_buffer, fields);
+    suffix_buffer.append(terminal);
+
+    return suffix_buffer;
   }
 
 
 
+  constexpr size_t counter_capacity{32};
+
+  // Formats the counter shown after an entry which stands for count entries,
+  // followed by terminal.
+  [[nodiscard]] std::string_view format_counter(
+      std::array<char, counter_capacity>& buffer,
+      size_t                              count,
+      std::string_view                    terminal = {}
+  ) {
+    auto result = logcerr::impl::format::format_to_n(buffer.begin(), buffer.size(),
+                                                     " (x{}){}", count, terminal);
+    return {buffer.data(), static_cast<size_t>(result.out - buffer.begin())};
+  }
+
+
+
+  // Prefixes the first line of an entry with the name of its category.
+  [[nodiscard]] std::string_view with_category(
+      std::string_view category,
+      std::string_view line
+  ) {
+    if (category.empty()) {
+      return line;
+    }
+
+    label_buffer.assign(category);
+    label_buffer.append(": ");
+    label_buffer.append(line);
+
+    return label_buffer;
+  }
+
 
 
-  void print_message_unguarded(
+  void print_message(
+    output_buffer&                    out,
+    bool                              colored,
     logcerr::severity                 level,
+    std::string_view                  time,
     std::span<const std::string_view> lines,
     std::string_view                  thread_name,// NOLINT(*easily-swappable-parameters)
+    std::string_view                  category,
+    std::string_view                  fields,
     std::string_view                  terminal
   ) {
-    const bool colored = logcerr::is_colored();
-
     for (auto it = lines.begin(); it != lines.end(); ++it) {
-      auto term = (it + 1) == lines.end() ? terminal : std::string_view{"\n"};
+      auto term = (it + 1) == lines.end() ? with_fields(fields, terminal)
+                                          : std::string_view{"\n"};
 
       if (it == lines.begin()) {
-        write(std::cerr, format_main(colored, level,
-                                       logcerr::elapsed(), thread_name, *it, term));
+        format_main(out, colored, level, time, thread_name, with_category(category, *it),
+                    term);
       } else {
-        write(std::cerr, format_extra(colored, level, *it, term));
+        format_extra(out, colored, level, *it, term);
       }
     }
   }
@@ -205,92 +394,389 @@ namespace {
   class entry {
     public:
       entry(const entry&) = delete;
+      entry(entry&&)      = delete;
+      entry& operator=(const entry&) = delete;
+      entry& operator=(entry&&)      = delete;
 
-      entry(entry&& rhs) noexcept :
-        level      {rhs.level},
-        message    {std::move(rhs.message)},
-        thread_name{std::move(rhs.thread_name)},
-        lines      {split(message)}
-      {}
+      ~entry() = default;
 
-      entry& operator=(const entry&) = delete;
+      explicit entry(logcerr::impl::record&& rec) {
+        assign(std::move(rec));
+      }
 
-      entry& operator=(entry&& rhs) noexcept {
-        if (*this == rhs) {
-          count++;
-        } else {
-          level       = rhs.level;
-          message     = std::move(rhs.message);
-          thread_name = std::move(rhs.thread_name);
-          lines       = split(message);
-          count = 1;
-        }
 
-        return *this;
+
+      // Replaces the content of this entry, reusing its allocations. The
+      // previous message and fields are handed to rec instead of being freed.
+      void assign(logcerr::impl::record&& rec) {
+        level       = rec.level;
+        time        = rec.time;
+        fingerprint = rec.fingerprint;
+        thread_name = std::move(rec.thread_name);
+        category    = rec.category;
+        count       = 1;
+
+        message.swap(rec.message);
+        fields.swap(rec.fields);
+
+        split(lines, sanitized, message);
       }
 
-      ~entry() = default;
 
-      entry(logcerr::severity lev, std::string&& msg) :
-        level      {lev},
-        message    {std::move(msg)},
-        thread_name{logcerr::thread_name()},
-        lines      {split(message)}
-      {}
 
+      // Counts rec as repetition of this entry if they are equal.
+      // Two entries are equal if they have the same message, fields, severity,
+      // category, and thread_name. The fingerprint rules out most differing
+      // entries without comparing their messages.
+      [[nodiscard]] bool absorb(const logcerr::impl::record& rec) {
+        if (fingerprint != rec.fingerprint || level != rec.level
+            || (thread_name != rec.thread_name && *thread_name != *rec.thread_name)
+            || category != rec.category || message != rec.message
+            || fields != rec.fields) {
+          return false;
+        }
 
+        time = rec.time;
+        count++;
 
-      [[nodiscard]] bool operator==(const entry& rhs) const {
-        return level     == rhs.level
-          && message     == rhs.message
-          && thread_name == rhs.thread_name;
-      };
+        return true;
+      }
 
 
 
-      void print_unguarded(size_t merge) const {
+      // Once count exceeds merge, only the last line is printed again with
+      // a counter, replacing the line printed before.
+      void render(output_buffer& out, bool colored, size_t merge) const {
         if (count <= merge) {
-          if (global_state::last_message_returned) {
-            std::cerr.put('\n');
-          }
-
-          print_message_unguarded(level, lines, thread_name, "");
+          print_message(out, colored, level,
+                        timestamps.get(time, logcerr::timestamp_format()),
+                        lines, *thread_name, category, fields, "");
         } else {
+          std::array<char, counter_capacity> buffer{};
+          auto counter = with_fields(fields, format_counter(buffer, count + 1 - merge));
+
           if (lines.size() == 1) {
-            write(std::cerr, format_main(logcerr::is_colored(), level,
-                                        logcerr::elapsed(), thread_name, lines.front(),
-                                        format_counter(merge)));
+            format_main(out, colored, level,
+                        timestamps.get(time, logcerr::timestamp_format()), *thread_name,
+                        with_category(category, lines.front()), counter);
           } else if (lines.size() > 1) {
-            write(std::cerr, format_extra(logcerr::is_colored(), level,
-                                        lines.back(), format_counter(merge)));
+            format_extra(out, colored, level, lines.back(), counter);
           }
         }
+      }
 
-        global_state::last_message_returned = true;
+
+
+      [[nodiscard]] logcerr::entry_info info(size_t merge) const {
+        return {level, time, *thread_name, category, message, count, count > merge};
       }
 
+      [[nodiscard]] std::string_view structured_fields() const { return fields; }
+
 
 
     private:
-      logcerr::severity level;
-      std::string       message;
-      std::string       thread_name;
-      size_t            count{1};
+      logcerr::severity          level{};
+      std::chrono::microseconds  time{};
+      size_t                     fingerprint{};
+      std::string                message;
+      std::string                fields;
+      logcerr::impl::shared_name thread_name;
+      std::string_view           category;
+      size_t                     count{1};
 
       std::vector<std::string_view> lines;
+      // message with control characters replaced, if it contains any
+      std::string                   sanitized;
+  };
+
+
+
+
+
+  // The last distinct entries, see logcerr::merge_window. Entries are found by
+  // fingerprint through an open addressing hash table with linear probing and
+  // are kept in a list ordered by when they have last been seen, so that the
+  // least recently seen one is replaced once the window is full. Storage is
+  // allocated when resizing and reused afterwards.
+  class merge_window {
+    public:
+      struct slot {
+        logcerr::severity          level{};
+        std::chrono::microseconds  time{};
+        size_t                     fingerprint{};
+        std::string                message;
+        std::string                fields;
+        logcerr::impl::shared_name thread_name;
+        std::string_view           category;
+        // number of occurrences while in the window
+        size_t                     count{0};
+        // occurrences which have neither been printed nor counted on screen
+        size_t                     withheld{0};
+
+        [[nodiscard]] bool matches(const logcerr::impl::record& rec) const {
+          return fingerprint == rec.fingerprint && level == rec.level
+            && (thread_name == rec.thread_name || *thread_name == *rec.thread_name)
+            && category == rec.category && message == rec.message && fields == rec.fields;
+        }
+      };
 
 
 
-      [[nodiscard]] std::string format_counter(size_t coalesce) const {
-        return logcerr::format(" (x{})", count + 1 - coalesce);
+      [[nodiscard]] size_t capacity() const { return slots.size(); }
+
+      // Discards all entries.
+      void resize(size_t capacity) {
+        slots.assign(capacity, slot{});
+        links.assign(capacity, link{});
+        table.assign(std::bit_ceil(2 * capacity), none);
+        reset();
+      }
+
+
+
+      // Returns the entry equal to rec and marks it as seen last.
+      [[nodiscard]] slot* find(const logcerr::impl::record& rec) {
+        for (size_t i = home(rec.fingerprint); table[i] != none; i = next_bucket(i)) {
+          if (auto& candidate = slots[table[i]]; candidate.matches(rec)) {
+            unlink(table[i]);
+            append(table[i]);
+            return &candidate;
+          }
+        }
+
+        return nullptr;
       }
+
+
+
+      // Adds rec as entry seen last. If the window is full, the entry seen
+      // least recently is passed to evict before it is replaced.
+      template<typename Evict>
+      slot& insert(const logcerr::impl::record& rec, Evict&& evict) {
+        size_t index{used};
+
+        if (used < slots.size()) {
+          ++used;
+        } else {
+          index = oldest;
+          std::forward<Evict>(evict)(slots[index]);
+          erase(index);
+          unlink(index);
+        }
+
+        auto& target = slots[index];
+        target.level       = rec.level;
+        target.time        = rec.time;
+        target.fingerprint = rec.fingerprint;
+        target.thread_name = rec.thread_name;
+        target.category    = rec.category;
+        target.count       = 1;
+        target.withheld    = 0;
+        target.message.assign(rec.message);
+        target.fields.assign(rec.fields);
+
+        size_t bucket{home(rec.fingerprint)};
+        while (table[bucket] != none) {
+          bucket = next_bucket(bucket);
+        }
+        table[bucket] = index;
+
+        append(index);
+
+        return target;
+      }
+
+
+
+      // Passes all entries to visit, least recently seen first, and discards
+      // them afterwards.
+      template<typename Visit>
+      void clear(Visit&& visit) {
+        for (size_t index = oldest; index != none; index = links[index].next) {
+          visit(slots[index]);
+        }
+
+        std::ranges::fill(table, none);
+        reset();
+      }
+
+
+
+    private:
+      static constexpr size_t none{~size_t{0}};
+
+      struct link {
+        size_t previous{none};
+        size_t next    {none};
+      };
+
+      std::vector<slot>   slots;
+      std::vector<link>   links;
+      // index into slots per bucket, or none
+      std::vector<size_t> table;
+
+      size_t used  {0};
+      size_t oldest{none};
+      size_t newest{none};
+
+
+
+      [[nodiscard]] size_t home(size_t fingerprint) const {
+        return fingerprint & (table.size() - 1);
+      }
+
+      [[nodiscard]] size_t next_bucket(size_t bucket) const {
+        return (bucket + 1) & (table.size() - 1);
+      }
+
+
+
+      void reset() {
+        used   = 0;
+        oldest = none;
+        newest = none;
+      }
+
+
+
+      void append(size_t index) {
+        links[index] = link{newest, none};
+
+        if (newest != none) {
+          links[newest].next = index;
+        } else {
+          oldest = index;
+        }
+        newest = index;
+      }
+
+      void unlink(size_t index) {
+        const auto [previous, next] = links[index];
+
+        (previous != none ? links[previous].next : oldest) = next;
+        (next     != none ? links[next].previous : newest) = previous;
+      }
+
+
+
+      // Removes index from table, moving entries of the same probe sequence
+      // back into the gap (backward shift deletion).
+      void erase(size_t index) {
+        size_t gap{home(slots[index].fingerprint)};
+        while (table[gap] != index) {
+          gap = next_bucket(gap);
+        }
+
+        for (size_t bucket = next_bucket(gap); table[bucket] != none;
+             bucket = next_bucket(bucket)) {
+          const size_t wanted{home(slots[table[bucket]].fingerprint)};
+
+          // an entry may only move back if its home is not within (gap, bucket]
+          const bool stays = gap <= bucket ? (gap < wanted && wanted <= bucket)
+                                           : (gap < wanted || wanted <= bucket);
+          if (!stays) {
+            table[gap] = table[bucket];
+            gap        = bucket;
+          }
+        }
+
+        table[gap] = none;
+      }
+  };
+}
+
+
+
+namespace {
+  struct sink_slot {
+    std::shared_ptr<logcerr::sink> target;
+    logcerr::sink_options          options;
+    bool                           terminal{false};
+    // true if the last line written to target has not been terminated yet
+    bool                           open    {false};
+    // strings already written to target if it uses output_encoding::binary
+    logcerr::impl::binary_encoder  binary{};
+
+
+
+    [[nodiscard]] bool colored() const {
+      switch (options.color.value_or(logcerr::colorize())) {
+        case logcerr::color_mode::always:
+          return true;
+        case logcerr::color_mode::never:
+          return false;
+        default:
+          return terminal;
+      }
+    }
+
+
+
+    // Index into entry_buffers: plain text, colored text, json, logfmt.
+    [[nodiscard]] size_t variant() const {
+      switch (options.encoding) {
+        case logcerr::output_encoding::json_lines:
+          return 2;
+        case logcerr::output_encoding::logfmt:
+          return 3;
+        default:
+          return colored() ? 1 : 0;
+      }
+    }
+
+
+
+    void terminate_line() {
+      if (open) {
+        target->write(nullptr, "\n");
+        open = false;
+      }
+    }
   };
 }
 
 
 
 namespace { namespace global_state {
-  std::optional<entry> last_message; // guarded by output_mutex
+  // guarded by output_mutex
+  std::vector<sink_slot> sinks;
+  bool                   defaults_attached{false};
+
+  std::atomic<bool>      binary_sinks{false};
+
+  std::optional<entry>   last_message;
+  merge_window           window;
+
+
+
+  class terminator_t {
+    public:
+      terminator_t(const terminator_t&) = delete;
+      terminator_t(terminator_t&&)      = delete;
+      terminator_t& operator=(const terminator_t&) = delete;
+      terminator_t& operator=(terminator_t&&)      = delete;
+
+      terminator_t() = default;
+
+      ~terminator_t() {
+        logcerr::impl::stop_writer();
+        logcerr::stop_mapped_log();
+
+        {
+          const std::lock_guard<std::mutex> lock{output_mutex};
+          logcerr::impl::interrupt_merging_unguarded();
+          logcerr::impl::flush_sinks_unguarded();
+        }
+
+        // entries created during the remaining static destruction are written
+        // immediately, which also stops the thread flushing stderr periodically
+        logcerr::stderr_sink()->buffering(logcerr::buffer_policy{});
+        // restores blocking mode, which may be shared with other processes
+        logcerr::stderr_sink()->nonblocking(logcerr::backlog_policy{});
+        logcerr::stderr_sink()->uring(logcerr::uring_policy{});
+      }
+  } terminator;
 }}
 
 
@@ -298,26 +784,388 @@ namespace { namespace global_state {
 
 
 namespace {
-  void interrupt_merging_unguarded() {
-    global_state::last_message = {};
-    if (global_state::last_message_returned) {
-      std::cerr.put('\n');
-      global_state::last_message_returned = false;
+  // requires output_mutex to be held
+  [[nodiscard]] std::vector<sink_slot>& sinks_unguarded() {
+    if (!global_state::defaults_attached) {
+      global_state::defaults_attached = true;
+
+      auto target = logcerr::stderr_sink();
+      const bool terminal = target->terminal();
+      global_state::sinks.push_back(sink_slot{std::move(target), {}, terminal});
+    }
+
+    return global_state::sinks;
+  }
+
+
+
+  // Updates binary_sinks after sinks have changed.
+  // Requires output_mutex to be held.
+  void update_binary_unguarded() {
+    global_state::binary_sinks = std::ranges::any_of(global_state::sinks,
+        [](const sink_slot& slot) {
+      return slot.options.encoding == logcerr::output_encoding::binary;
+    });
+  }
+
+
+
+  // Checks if any sink accepting entries of level needs their formatted
+  // message, i.e. does not use output_encoding::binary.
+  // Requires output_mutex to be held.
+  [[nodiscard]] bool formatted_unguarded(logcerr::severity level) {
+    return std::ranges::any_of(sinks_unguarded(), [level](const sink_slot& slot) {
+      return level >= slot.options.level
+        && slot.options.encoding != logcerr::output_encoding::binary;
+    });
+  }
+
+
+
+  void encode(
+      output_buffer&             out,
+      size_t                     variant,
+      const logcerr::entry_info& info,
+      std::string_view           fields
+  ) {
+    auto time = timestamps.get(info.time, logcerr::timestamp_format());
+
+    if (variant == 2) {
+      logcerr::impl::encode_json(out, info, time, fields);
+    } else {
+      logcerr::impl::encode_logfmt(out, info, time, fields);
+    }
+  }
+
+
+
+  thread_local output_buffer binary_buffer;
+
+  // Writes an entry to all sinks accepting its severity, formatting it at most
+  // once per variant. Every variant starts with a line break, which is only
+  // written to sinks whose last line has not been terminated yet. Structured
+  // encodings always terminate their lines. Binary encodings are created per
+  // sink, using the arguments of deferred if possible.
+  // Requires output_mutex to be held.
+  template<typename Render>
+  void emit_unguarded(
+      const logcerr::entry_info&              info,
+      std::string_view                        fields,
+      const logcerr::impl::deferred_message*  deferred,
+      bool                                    open,
+      Render&&                                render
+  ) {
+    std::array<bool, variant_count> rendered{};
+
+    for (auto& slot: sinks_unguarded()) {
+      if (info.level < slot.options.level) {
+        continue;
+      }
+
+      if (slot.options.encoding == logcerr::output_encoding::binary) {
+        binary_buffer.clear();
+        slot.binary.encode(binary_buffer, info, fields, deferred);
+        slot.target->write(&info, binary_buffer);
+
+        logcerr::impl::count_bytes(binary_buffer.size());
+        continue;
+      }
+
+      const size_t variant = slot.variant();
+      const bool   text    = slot.options.encoding == logcerr::output_encoding::text;
+      auto&        out     = entry_buffers.at(variant);
+
+      if (!rendered.at(variant)) {
+        out.assign(1, '\n');
+        if (text) {
+          render(out, variant == 1);
+        } else {
+          encode(out, variant, info, fields);
+        }
+        rendered.at(variant) = true;
+      }
+
+      std::string_view output{out};
+      if ((text && info.update) || !slot.open) {
+        output.remove_prefix(1);
+      }
+
+      slot.target->write(&info, output);
+      slot.open = text && open;
+
+      logcerr::impl::count_bytes(output.size());
+    }
+  }
+}
+
+
+
+
+
+namespace {
+  [[nodiscard]] logcerr::impl::record make_record(
+      logcerr::severity level,
+      std::string_view  category
+  ) {
+    logcerr::impl::record rec;
+
+    rec.level       = level;
+    rec.time        = logcerr::impl::timestamp();
+    rec.thread_name = logcerr::impl::current_thread_name();
+    rec.category    = category;
+
+    return rec;
+  }
+
+
+
+  thread_local output_buffer                 mapped_buffer;
+  thread_local std::string                   mapped_message;
+  thread_local std::vector<std::string_view> mapped_lines;
+  thread_local std::string                   mapped_storage;
+
+  // Formats rec in the plain text layout on the calling thread and appends it
+  // to the mapped log. Returns true if rec must not be written to the sinks.
+  [[nodiscard]] bool write_mapped(const logcerr::impl::record& rec) {
+    std::string_view message{rec.message};
+    if (!rec.deferred.empty()) {
+      mapped_message.clear();
+      rec.deferred.format_to(mapped_message);
+      message = mapped_message;
     }
+
+    split(mapped_lines, mapped_storage, message);
+
+    mapped_buffer.clear();
+    print_message(mapped_buffer, false, rec.level,
+                  timestamps.get(rec.time, logcerr::timestamp_format()), mapped_lines,
+                  *rec.thread_name, rec.category, rec.fields, "\n");
+
+    return logcerr::impl::append_mapped(mapped_buffer);
   }
 
 
 
-  void basic_print(logcerr::severity level, std::string&& message) {
-    const std::lock_guard<std::mutex> lock{global_state::output_mutex};
+  void dispatch(logcerr::impl::record& rec) {
+    if (logcerr::impl::mapping() && write_mapped(rec)) {
+      return;
+    }
 
-    if (auto merge = logcerr::merge_after(); merge > 0) {
-      global_state::last_message = entry{level, std::move(message)};
-      global_state::last_message->print_unguarded(merge);
+    if (logcerr::impl::enqueue(rec)) {
+      return;
+    }
+
+    const logcerr::impl::output_guard lock;
+    logcerr::impl::print_unguarded(std::move(rec));
+  }
+
+
+
+  // Afterwards, message holds a buffer which has been handed back by the
+  // output and can be reused.
+  void basic_print(logcerr::severity level, std::string_view category,
+                   std::string& message, std::string&& fields = {}) {
+    auto rec = make_record(level, category);
+
+    logcerr::impl::count_entry(level);
+
+    if (logcerr::impl::recording()) {
+      logcerr::impl::record_flight(level, rec.time, *rec.thread_name, message);
+    }
+
+    rec.fingerprint = fingerprint(level, message, fields);
+    rec.message.swap(message);
+    rec.fields      = std::move(fields);
+
+    dispatch(rec);
+
+    message.swap(rec.message);
+  }
+
+
+
+  thread_local std::string message_arena;
+  thread_local bool        message_arena_reserved{false};
+}
+
+
+
+
+
+namespace {
+  // Writes an entry of the window once more, followed by the number of its
+  // occurrences which have been withheld, if any. The report ends the chain
+  // of merged entries on screen.
+  // Requires output_mutex to be held.
+  void report_unguarded(const merge_window::slot& seen) {
+    if (seen.withheld == 0) {
+      return;
+    }
+
+    global_state::last_message.reset();
+
+    split(line_buffer, line_storage, seen.message);
+    auto time = timestamps.get(seen.time, logcerr::timestamp_format());
+
+    std::array<char, counter_capacity> buffer{};
+    const auto counter = format_counter(buffer, seen.withheld, "\n");
+
+    const logcerr::entry_info info{seen.level, seen.time, *seen.thread_name, seen.category,
+                                   seen.message, seen.withheld, false};
+
+    emit_unguarded(info, seen.fields, nullptr, false, [&](output_buffer& out, bool colored) {
+      print_message(out, colored, seen.level, time, line_buffer, *seen.thread_name,
+                    seen.category, seen.fields, counter);
+    });
+  }
+
+
+
+  // Counts rec as occurrence of an entry of the window, adding it if
+  // necessary. Returns true if rec must not be printed, because its entry is
+  // not the last one and has been printed merge times already.
+  // Requires output_mutex to be held.
+  [[nodiscard]] bool withhold_unguarded(const logcerr::impl::record& rec, size_t merge) {
+    auto& window = global_state::window;
+
+    if (auto* seen = window.find(rec)) {
+      seen->count++;
+      seen->time = rec.time;
+
+      if (seen->count > merge) {
+        seen->withheld++;
+        return true;
+      }
+      return false;
+    }
+
+    window.insert(rec, report_unguarded);
+    return false;
+  }
+}
+
+
+
+
+
+std::mutex& logcerr::impl::output_mutex() {
+  return global_state::output_mutex;
+}
+
+
+
+void logcerr::impl::print_unguarded(record&& rec) {
+  const deferred_message* deferred{nullptr};
+
+  if (!rec.deferred.empty()) {
+    deferred = &rec.deferred;
+
+    if (rec.deferred.portable() && !formatted_unguarded(rec.level)) {
+      // only binary sinks accept this entry, which do not take part in merging
+      const entry_info info{rec.level, rec.time, *rec.thread_name, rec.category, {}, 1,
+                            false};
+      emit_unguarded(info, rec.fields, deferred, false, [](output_buffer&, bool) {});
+      return;
+    }
+
+    rec.message.clear();
+    rec.deferred.format_to(rec.message);
+    rec.fingerprint = fingerprint(rec.level, rec.message, rec.fields);
+  }
+
+  if (auto merge = logcerr::merge_after(); merge > 0) {
+    auto& last      = global_state::last_message;
+    const bool wide = global_state::window.capacity() > 1;
+
+    if (last && last->absorb(rec)) {
+      if (auto* seen = wide ? global_state::window.find(rec) : nullptr) {
+        seen->count++;
+        seen->time = rec.time;
+      }
+      count_merged();
     } else {
-      print_message_unguarded(level, split(message), logcerr::thread_name(), "\n");
-      global_state::last_message_returned = false;
+      if (wide && withhold_unguarded(rec, merge)) {
+        count_merged();
+        return;
+      }
+
+      if (!last) {
+        last.emplace(std::move(rec));
+      } else {
+        last->assign(std::move(rec));
+      }
     }
+
+    const auto& current = *last;
+    // assign leaves the deferred message of rec untouched
+    emit_unguarded(current.info(merge), current.structured_fields(), deferred, true,
+                   [&](output_buffer& out, bool colored) {
+      current.render(out, colored, merge);
+    });
+  } else {
+    split(line_buffer, line_storage, rec.message);
+    auto time = timestamps.get(rec.time, logcerr::timestamp_format());
+
+    const entry_info info{rec.level, rec.time, *rec.thread_name, rec.category, rec.message,
+                          1, false};
+
+    emit_unguarded(info, rec.fields, deferred, false, [&](output_buffer& out, bool colored) {
+      print_message(out, colored, rec.level, time, line_buffer, *rec.thread_name, rec.category,
+                    rec.fields, "\n");
+    });
+  }
+}
+
+
+
+void logcerr::impl::interrupt_merging_unguarded() {
+  global_state::window.clear(report_unguarded);
+  global_state::last_message.reset();
+
+  for (auto& slot: sinks_unguarded()) {
+    slot.terminate_line();
+  }
+}
+
+
+
+void logcerr::impl::append_text(
+    std::string&                          out,
+    bool                                  colored,
+    const entry_info&                     info,
+    std::string_view                      fields,
+    time_format                           format,
+    std::chrono::system_clock::time_point start
+) {
+  time_cache clock;
+
+  std::vector<std::string_view> lines;
+  std::string                   storage;
+  split(lines, storage, info.message);
+
+  print_message(out, colored, info.level, clock.get(info.time, format, start), lines,
+                info.thread_name, info.category, fields, "\n");
+
+  // lines written to stderr start with a carriage return, see format_main
+  for (size_t pos = out.find("\n\r"); pos != std::string::npos; pos = out.find("\n\r", pos)) {
+    out.erase(++pos, 1);
+  }
+  if (out.starts_with('\r')) {
+    out.erase(0, 1);
+  }
+}
+
+
+
+bool logcerr::impl::binary_output() noexcept {
+  return global_state::binary_sinks.load(std::memory_order_relaxed);
+}
+
+
+
+void logcerr::impl::flush_sinks_unguarded() {
+  for (auto& slot: sinks_unguarded()) {
+    slot.target->flush();
   }
 }
 
@@ -326,13 +1174,92 @@ namespace {
 
 
 void logcerr::impl::print(severity level, std::string&& message) {
-  basic_print(level, std::move(message));
+  basic_print(level, {}, message);
+}
+
+void logcerr::impl::print(
+    severity         level,
+    std::string_view category,
+    std::string&&    message,
+    std::string&&    fields
+) {
+  basic_print(level, category, message, std::move(fields));
+}
+
+void logcerr::impl::print(
+    severity                level,
+    std::string_view        category,
+    const deferred_message& message
+) {
+  auto rec = make_record(level, category);
+  rec.deferred = message;
+
+  count_entry(level);
+
+  if (recording()) {
+    const auto  lease = record_buffer();
+    std::string fallback;
+    auto&       buffer = lease.get() != nullptr ? *lease.get() : fallback;
+
+    message.format_to(buffer);
+    record_flight(level, rec.time, *rec.thread_name, buffer);
+  }
+
+  dispatch(rec);
 }
 
 void logcerr::impl::print_checked(severity level, std::string_view message) {
   if (is_outputted(level)) {
-    basic_print(level, std::string{message});
+    if (const auto lease = message_buffer(); auto* buffer = lease.get()) {
+      buffer->assign(message);
+      print_buffered(level, {});
+    } else {
+      std::string text{message};
+      basic_print(level, {}, text);
+    }
+  } else if (filtered_out(level)) {
+    record_flight(level, message);
+  }
+}
+
+
+
+logcerr::impl::buffer_lease logcerr::impl::message_buffer() {
+  const size_t size{global_state::preallocated.load(std::memory_order_relaxed)};
+  if (size == 0 || message_arena_reserved) {
+    return {};
   }
+
+  auto& buffer = message_arena;
+
+  // the capacity of a buffer reserved from its inline storage may be rounded
+  // up to twice its previous capacity
+  if (buffer.capacity() > 2 * size) {
+    buffer = std::string{};
+  }
+
+  buffer.clear();
+  buffer.reserve(size);
+
+  return {buffer, message_arena_reserved};
+}
+
+
+
+void logcerr::impl::print_buffered(severity level, std::string_view category) {
+  basic_print(level, category, message_arena);
+}
+
+
+
+void logcerr::preallocate(size_t size) {
+  global_state::preallocated.store(size, std::memory_order_relaxed);
+}
+
+
+
+size_t logcerr::preallocate() noexcept {
+  return global_state::preallocated.load(std::memory_order_relaxed);
 }
 
 
@@ -340,17 +1267,45 @@ void logcerr::impl::print_checked(severity level, std::string_view message) {
 
 
 void logcerr::interrupt_merging() {
+  impl::flush_writer();
+
   const std::lock_guard<std::mutex> lock{global_state::output_mutex};
 
-  interrupt_merging_unguarded();
+  impl::interrupt_merging_unguarded();
+}
+
+
+
+void logcerr::merge_window(size_t entries) {
+  if (entries == 0) {
+    throw std::invalid_argument{"expected a positive window size"};
+  }
+
+  impl::flush_writer();
+
+  const std::lock_guard<std::mutex> lock{global_state::output_mutex};
+
+  global_state::window.clear(report_unguarded);
+  global_state::window.resize(entries > 1 ? entries : 0);
+}
+
+
+
+size_t logcerr::merge_window() {
+  const std::lock_guard<std::mutex> lock{global_state::output_mutex};
+
+  return std::max<size_t>(global_state::window.capacity(), 1);
 }
 
 
 
 void logcerr::print_raw_sync(std::ostream& out, std::string_view message) {
+  impl::flush_writer();
+
   const std::lock_guard<std::mutex> lock{global_state::output_mutex};
 
-  interrupt_merging_unguarded();
+  impl::interrupt_merging_unguarded();
+  impl::flush_sinks_unguarded();
 
   write(out, message);
 }
@@ -358,9 +1313,101 @@ void logcerr::print_raw_sync(std::ostream& out, std::string_view message) {
 
 
 std::unique_lock<std::mutex> logcerr::output_lock() {
+  impl::flush_writer();
+
   std::unique_lock<std::mutex> lock{global_state::output_mutex};
 
-  interrupt_merging_unguarded();
+  impl::interrupt_merging_unguarded();
+  impl::flush_sinks_unguarded();
 
   return lock;
 }
+
+
+
+void logcerr::flush() {
+  if (impl::writer_thread()) {
+    // called by a sink or formatter, output_mutex is already held
+    impl::flush_sinks_unguarded();
+    return;
+  }
+
+  impl::flush_writer();
+
+  const std::lock_guard<std::mutex> lock{global_state::output_mutex};
+
+  impl::flush_sinks_unguarded();
+}
+
+
+
+
+
+void logcerr::attach(std::shared_ptr<sink> target, const sink_options& options) {
+  if (!target) {
+    throw std::invalid_argument{"expected a sink"};
+  }
+
+  const bool terminal = target->terminal();
+
+  const std::lock_guard<std::mutex> lock{global_state::output_mutex};
+
+  auto& sinks = sinks_unguarded();
+
+  auto it = std::ranges::find(sinks, target, &sink_slot::target);
+  if (it != sinks.end()) {
+    it->options  = options;
+    it->terminal = terminal;
+  } else {
+    sinks.push_back(sink_slot{std::move(target), options, terminal});
+  }
+
+  update_binary_unguarded();
+}
+
+
+
+void logcerr::detach(const std::shared_ptr<sink>& target) {
+  impl::flush_writer();
+
+  // released after unlocking, since destroying a sink may wait for a thread
+  // which takes the output lock
+  std::shared_ptr<sink> removed;
+
+  const std::lock_guard<std::mutex> lock{global_state::output_mutex};
+
+  auto& sinks = sinks_unguarded();
+
+  auto it = std::ranges::find(sinks, target, &sink_slot::target);
+  if (it == sinks.end()) {
+    return;
+  }
+
+  it->terminate_line();
+  it->target->flush();
+
+  removed = std::move(it->target);
+  sinks.erase(it);
+
+  update_binary_unguarded();
+}
+
+
+
+void logcerr::detach_all() {
+  impl::flush_writer();
+
+  // released after unlocking, see detach
+  std::vector<sink_slot> removed;
+
+  const std::lock_guard<std::mutex> lock{global_state::output_mutex};
+
+  for (auto& slot: sinks_unguarded()) {
+    slot.terminate_line();
+    slot.target->flush();
+  }
+
+  removed.swap(global_state::sinks);
+
+  update_binary_unguarded();
+}
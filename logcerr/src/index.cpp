@@ -0,0 +1,202 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/log_index.hpp"
+#include "logcerr/sink.hpp"
+#include "src/output.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+
+// An index starts with magic, followed by one stored_block per block in native
+// byte order.
+
+namespace {
+  constexpr std::string_view magic{"LOGCIDX\x01", 8};
+
+  struct stored_block {
+    uint64_t                begin;
+    uint64_t                end;
+    int64_t                 earliest;
+    int64_t                 latest;
+    std::array<uint32_t, 5> entries;
+    uint32_t                reserved;
+  };
+
+  static_assert(std::is_trivially_copyable_v<stored_block>);
+
+
+
+  [[nodiscard]] int create_file(const std::filesystem::path& path) {
+    //NOLINTNEXTLINE(*-vararg)
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+      throw std::system_error{errno, std::generic_category(),
+                              "cannot open " + path.string()};
+    }
+
+    return fd;
+  }
+
+
+
+  [[nodiscard]] std::filesystem::path side_car(std::filesystem::path path) {
+    path += ".idx";
+    return path;
+  }
+}
+
+
+
+
+
+logcerr::indexed_sink::indexed_sink(std::filesystem::path path, const index_policy& policy) :
+  file  {std::move(path)},
+  policy{policy},
+  target{std::make_shared<fd_sink>(create_file(file), true)}
+{
+  index_fd = create_file(index_path());
+  impl::write_fd(index_fd, magic);
+}
+
+
+
+logcerr::indexed_sink::~indexed_sink() {
+  close_block();
+  close(index_fd);
+}
+
+
+
+std::filesystem::path logcerr::indexed_sink::index_path() const {
+  return side_car(file);
+}
+
+
+
+void logcerr::indexed_sink::write(const entry_info* info, std::string_view text) {
+  if (info != nullptr) {
+    if (entries > 0 && ((policy.entries > 0 && entries >= policy.entries)
+                        || (policy.bytes > 0 && offset - begin >= policy.bytes))) {
+      close_block();
+    }
+
+    if (entries == 0) {
+      begin    = offset;
+      earliest = info->time;
+    }
+
+    entries++;
+    earliest = std::min(earliest, info->time);
+    latest   = std::max(latest, info->time);
+    counts.at(static_cast<size_t>(info->level))++;
+  }
+
+  target->write(info, text);
+  offset += text.size();
+}
+
+
+
+void logcerr::indexed_sink::flush() {
+  close_block();
+  target->flush();
+}
+
+
+
+void logcerr::indexed_sink::close_block() {
+  if (entries == 0) {
+    return;
+  }
+
+  const stored_block block{
+    .begin    = begin,
+    .end      = offset,
+    .earliest = earliest.count(),
+    .latest   = latest.count(),
+    .entries  = counts,
+    .reserved = 0,
+  };
+
+  //NOLINTNEXTLINE(*-reinterpret-cast)
+  impl::write_fd(index_fd, {reinterpret_cast<const char*>(&block), sizeof(block)});
+
+  entries = 0;
+  counts  = {};
+}
+
+
+
+
+
+logcerr::log_index::log_index(const std::filesystem::path& index_path) {
+  std::ifstream input{index_path, std::ios::binary};
+  if (!input) {
+    throw std::system_error{errno, std::generic_category(),
+                            "cannot read " + index_path.string()};
+  }
+
+  std::array<char, magic.size()> header{};
+  input.read(header.data(), header.size());
+  if (std::string_view{header.data(), header.size()} != magic) {
+    throw std::runtime_error{"not a log index: " + index_path.string()};
+  }
+
+  stored_block block{};
+  //NOLINTNEXTLINE(*-reinterpret-cast)
+  while (input.read(reinterpret_cast<char*>(&block), sizeof(block))) {
+    list.push_back(index_block{
+      .begin    = block.begin,
+      .end      = block.end,
+      .earliest = std::chrono::microseconds{block.earliest},
+      .latest   = std::chrono::microseconds{block.latest},
+      .entries  = block.entries,
+    });
+  }
+}
+
+
+
+logcerr::byte_range logcerr::log_index::find(
+    std::chrono::microseconds from,
+    std::chrono::microseconds until
+) const {
+  // all blocks before first only hold entries created before from
+  auto first = std::ranges::partition_point(list, [from](const index_block& block) {
+    return block.latest < from;
+  });
+
+  if (first == list.end()) {
+    return {list.empty() ? 0 : list.back().end, byte_range::unbounded};
+  }
+
+  auto last = std::find_if(first, list.end(), [until](const index_block& block) {
+    return block.earliest >= until;
+  });
+
+  return {first->begin, last == list.end() ? byte_range::unbounded : last->begin};
+}
+
+
+
+std::vector<logcerr::index_block> logcerr::log_index::find(severity level) const {
+  std::vector<index_block> output;
+
+  std::ranges::copy_if(list, std::back_inserter(output), [level](const index_block& block) {
+    return std::any_of(block.entries.begin() + static_cast<ptrdiff_t>(level),
+                       block.entries.end(), [](uint32_t count) { return count > 0; });
+  });
+
+  return output;
+}
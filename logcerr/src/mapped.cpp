@@ -0,0 +1,348 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/mapped_log.hpp"
+#include "src/output.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+
+
+namespace {
+  [[noreturn]] void throw_error(int error, const std::string& message) {
+    throw std::system_error{error, std::generic_category(), message};
+  }
+
+
+
+  // A single file of a mapped log. The whole max_size is mapped up front,
+  // while the file itself is extended in steps of grow_by ahead of writers,
+  // since touching a mapped page beyond the end of the file raises SIGBUS.
+  class mapped_file {
+    public:
+      mapped_file(const mapped_file&) = delete;
+      mapped_file(mapped_file&&)      = delete;
+      mapped_file& operator=(const mapped_file&) = delete;
+      mapped_file& operator=(mapped_file&&)      = delete;
+
+      mapped_file(const std::filesystem::path& path, const logcerr::mapped_log_options& options) :
+        grow_by {options.grow_by},
+        max_size{options.max_size},
+        limit   {options.max_size}
+      {
+        //NOLINTNEXTLINE(*-vararg)
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+          throw_error(errno, "cannot create " + path.string());
+        }
+
+        void* mapping = mmap(nullptr, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+          const int error = errno;
+          ::close(fd);
+          throw_error(error, "cannot map " + path.string());
+        }
+        base = static_cast<char*>(mapping);
+
+        if (!grow(std::min(grow_by, max_size))) {
+          const int error = errno;
+          close();
+          throw_error(error, "cannot extend " + path.string());
+        }
+      }
+
+      ~mapped_file() = default;
+
+
+
+      // Returns false if data does not fit into this file anymore.
+      [[nodiscard]] bool append(std::string_view data) {
+        const size_t start{next.fetch_add(data.size(), std::memory_order_relaxed)};
+
+        if (start >= max_size || max_size - start < data.size()) {
+          if (start < max_size) {
+            // the only claim crossing max_size marks the end of the data
+            limit.store(start, std::memory_order_relaxed);
+          }
+          return false;
+        }
+
+        const size_t end{start + data.size()};
+        if (end > allocated.load(std::memory_order_acquire) && !grow(end)) {
+          // the range stays filled with NUL bytes, like after a crash
+          return true;
+        }
+
+        std::memcpy(base + start, data.data(), data.size());
+        return true;
+      }
+
+
+
+      // Unmaps and truncates the file to its used size. Must only be called
+      // once no writer uses this file anymore.
+      void close() {
+        if (base != nullptr) {
+          munmap(base, max_size);
+          base = nullptr;
+        }
+
+        const size_t used{std::min(next.load(), limit.load())};
+        if (used < allocated.load()) {
+          static_cast<void>(ftruncate(fd, static_cast<off_t>(used)));
+        }
+
+        ::close(fd);
+      }
+
+
+
+    private:
+      size_t grow_by;
+      size_t max_size;
+
+      int   fd{-1};
+      char* base{nullptr};
+
+      std::atomic<size_t> next     {0};
+      std::atomic<size_t> allocated{0};
+      std::atomic<size_t> limit;
+
+      std::mutex          grow_mutex;
+
+
+
+      [[nodiscard]] bool grow(size_t end) {
+        const std::lock_guard<std::mutex> lock{grow_mutex};
+
+        size_t size{allocated.load(std::memory_order_relaxed)};
+        if (size >= end) {
+          return true;
+        }
+
+        while (size < end) {
+          size = std::min(max_size, size + grow_by);
+        }
+
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+          return false;
+        }
+
+        allocated.store(size, std::memory_order_release);
+        return true;
+      }
+  };
+
+
+
+  // A mapped_file together with the number of writers currently using it.
+  // Generations are never destroyed, so that a writer may still increment
+  // users of a generation which has just been replaced; only their files are
+  // closed.
+  struct generation {
+    generation(const std::filesystem::path& path, const logcerr::mapped_log_options& opts) :
+      file{path, opts}, path{path}, options{opts}
+    {}
+
+    mapped_file                  file;
+    std::filesystem::path        path;
+    logcerr::mapped_log_options  options;
+    std::atomic<size_t>          users{0};
+  };
+}
+
+
+
+
+
+namespace { namespace global_state {
+  std::mutex               roll_mutex;
+  std::atomic<generation*> current{nullptr};
+}}
+
+
+
+
+
+namespace {
+  [[nodiscard]] generation* acquire() {
+    auto* gen = global_state::current.load();
+
+    while (gen != nullptr) {
+      gen->users.fetch_add(1);
+
+      if (auto* active = global_state::current.load(); active == gen) {
+        return gen;
+      } else {
+        gen->users.fetch_sub(1);
+        gen = active;
+      }
+    }
+
+    return nullptr;
+  }
+
+
+
+  // Requires roll_mutex to be held.
+  void retire_unguarded(generation* gen) {
+    if (gen == nullptr) {
+      return;
+    }
+
+    while (gen->users.load() > 0) {
+      std::this_thread::yield();
+    }
+
+    gen->file.close();
+  }
+
+
+
+  void roll_over(generation* full) {
+    const std::lock_guard<std::mutex> lock{global_state::roll_mutex};
+
+    if (global_state::current.load() != full) {
+      return;
+    }
+
+    // the full file remains open and mapped until all writers are done
+    logcerr::impl::shift_files(full->path, full->options.keep);
+
+    generation* next{nullptr};
+    try {
+      //NOLINTNEXTLINE(*-owning-memory)
+      next = new generation{full->path, full->options};
+    } catch (...) {
+      // entries are discarded until the mapped log is started again
+    }
+
+    global_state::current.store(next);
+    retire_unguarded(full);
+  }
+}
+
+
+
+
+
+void logcerr::mapped_log(const std::filesystem::path& path, const mapped_log_options& options) {
+  if (options.grow_by == 0 || options.max_size == 0) {
+    throw std::invalid_argument{"expected a positive grow_by and max_size"};
+  }
+
+  const std::lock_guard<std::mutex> lock{global_state::roll_mutex};
+
+  if (auto* active = global_state::current.load()) {
+    std::error_code error;
+    if (std::filesystem::equivalent(path, active->path, error)) {
+      // truncating the active file would discard entries which are still
+      // being written, it is rotated as if it was full instead
+      impl::shift_files(path, options.keep);
+    }
+  }
+
+  //NOLINTNEXTLINE(*-owning-memory)
+  auto* created = new generation{path, options};
+
+  retire_unguarded(global_state::current.exchange(created));
+}
+
+
+
+bool logcerr::mapped_log() noexcept {
+  return global_state::current.load() != nullptr;
+}
+
+
+
+void logcerr::stop_mapped_log() {
+  const std::lock_guard<std::mutex> lock{global_state::roll_mutex};
+
+  retire_unguarded(global_state::current.exchange(nullptr));
+}
+
+
+
+std::vector<std::string> logcerr::read_mapped_log(const std::filesystem::path& path) {
+  std::ifstream input{path, std::ios::binary};
+  if (!input) {
+    throw_error(errno, "cannot read " + path.string());
+  }
+
+  const std::string content{std::istreambuf_iterator<char>{input},
+                            std::istreambuf_iterator<char>{}};
+
+  std::vector<std::string> lines;
+
+  std::string_view rest{content};
+  while (!rest.empty()) {
+    auto end = rest.find('\n');
+    if (end == std::string_view::npos) {
+      // an incomplete entry or unused space at the end of the file
+      break;
+    }
+
+    auto line = rest.substr(0, end);
+    rest.remove_prefix(end + 1);
+
+    if (auto nul = line.rfind('\0'); nul != std::string_view::npos) {
+      line.remove_prefix(nul + 1);
+    }
+
+    if (line.starts_with('\r')) {
+      line.remove_prefix(1);
+    }
+
+    if (!line.empty()) {
+      lines.emplace_back(line);
+    }
+  }
+
+  return lines;
+}
+
+
+
+
+
+bool logcerr::impl::mapping() noexcept {
+  return global_state::current.load(std::memory_order_relaxed) != nullptr;
+}
+
+
+
+bool logcerr::impl::append_mapped(std::string_view text) {
+  while (auto* gen = acquire()) {
+    const bool written = gen->file.append(text);
+    const bool exclusive = gen->options.exclusive;
+    gen->users.fetch_sub(1);
+
+    if (written) {
+      count_bytes(text.size());
+      return exclusive;
+    }
+
+    if (text.size() > gen->options.max_size) {
+      return exclusive;
+    }
+
+    roll_over(gen);
+  }
+
+  return false;
+}
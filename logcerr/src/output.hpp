@@ -0,0 +1,252 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#ifndef LOGCERR_SRC_OUTPUT_HPP_INCLUDED
+#define LOGCERR_SRC_OUTPUT_HPP_INCLUDED
+
+#include "logcerr/log.hpp"
+#include "logcerr/sink.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+
+namespace logcerr::impl {
+  /// An immutable thread name which can be shared without copying.
+  using shared_name = std::shared_ptr<const std::string>;
+
+  /// Obtains the name of the current thread without taking a global lock
+  /// unless the name has changed since the last call.
+  [[nodiscard]] shared_name current_thread_name();
+
+
+
+  /// Obtains the time since start of the log with microsecond resolution.
+  [[nodiscard]] std::chrono::microseconds timestamp();
+
+  /// Converts a value obtained from timestamp to wall-clock time. The offset
+  /// between both clocks is cached and refreshed at most every few seconds.
+  [[nodiscard]] std::chrono::system_clock::time_point wall_clock(
+      std::chrono::microseconds time);
+
+
+
+  /// A finished log entry which has not been written yet.
+  struct record {
+    severity                  level{severity::log};
+    std::chrono::microseconds time{};
+    shared_name               thread_name;
+    std::string_view          category;
+    std::string               message;
+    std::string               fields;
+    size_t                    fingerprint{0};
+    deferred_message          deferred;
+  };
+
+
+
+  /// The mutex guarding all output performed by this library.
+  [[nodiscard]] std::mutex& output_mutex();
+
+  /// Locks output_mutex for writing an entry and, if statistics are
+  /// collected, measures how long acquiring and holding it takes.
+  class output_guard {
+    public:
+      output_guard(const output_guard&) = delete;
+      output_guard(output_guard&&)      = delete;
+      output_guard& operator=(const output_guard&) = delete;
+      output_guard& operator=(output_guard&&)      = delete;
+
+      output_guard();
+      ~output_guard();
+
+    private:
+      bool                                  timed;
+      std::chrono::steady_clock::time_point acquired;
+  };
+
+  /// Writes rec, merging it with the previous entry if possible.
+  /// Requires output_mutex to be held.
+  void print_unguarded(record&& rec);
+
+  /// Requires output_mutex to be held.
+  void interrupt_merging_unguarded();
+
+
+
+  /// Writes all of data to fd, retrying on partial writes and EINTR.
+  void write_fd(int fd, std::string_view data);
+
+  /// Renames path to path.1, path.1 to path.2, and so on, replacing path.keep.
+  /// With keep set to 0, path is removed.
+  void shift_files(const std::filesystem::path& path, size_t keep);
+
+  /// Writes to a descriptor through io_uring, see uring_policy.
+  /// All member functions require output_mutex to be held.
+  class ring {
+    public:
+      ring(const ring&) = delete;
+      ring(ring&&)      = delete;
+      ring& operator=(const ring&) = delete;
+      ring& operator=(ring&&)      = delete;
+
+      /// Returns nullptr if io_uring is unavailable.
+      [[nodiscard]] static std::unique_ptr<ring> create(int fd, const uring_policy& policy);
+
+      /// Stops the background thread reaping completions, which must have been
+      /// signaled by finish before.
+      virtual ~ring() = default;
+
+      [[nodiscard]] virtual const uring_policy& policy() const = 0;
+
+      /// Submits data after all previous output.
+      virtual void write(std::string_view data) = 0;
+
+      /// Blocks until all submitted writes have completed.
+      virtual void flush() = 0;
+
+      /// Flushes and signals the background thread to stop.
+      virtual void finish() = 0;
+
+    protected:
+      ring() = default;
+  };
+
+
+
+  /// Flushes all attached sinks.
+  /// Requires output_mutex to be held.
+  void flush_sinks_unguarded();
+
+
+
+  /// Splits text into lines, dropping trailing empty lines but keeping at
+  /// least one. Unless policy is control_policy::keep, control characters other
+  /// than line breaks and tabs are escaped or removed, in which case lines may
+  /// refer to storage instead of text. Both containers are reused. Scans 16 or
+  /// 32 bytes at once where SSE2 or AVX2 are available.
+  void split_lines(std::vector<std::string_view>& lines, std::string& storage,
+                   std::string_view text, control_policy policy);
+
+
+
+  [[nodiscard]] std::string_view severity_name(severity level);
+
+  /// Appends fields serialized by field_list as " key=value" pairs.
+  void append_fields_text(std::string& out, std::string_view fields);
+
+  /// Appends an entry as a single line of JSON.
+  void encode_json(std::string& out, const entry_info& info, std::string_view time,
+                   std::string_view fields);
+
+  /// Appends an entry as a single line of logfmt.
+  void encode_logfmt(std::string& out, const entry_info& info, std::string_view time,
+                     std::string_view fields);
+
+  /// Appends an entry in the text layout used for stderr, terminated by a line
+  /// break. start is the wall-clock time of the start of the log.
+  void append_text(std::string& out, bool colored, const entry_info& info,
+                   std::string_view fields, time_format format,
+                   std::chrono::system_clock::time_point start);
+
+
+
+  /// Encodes the entries written to a single sink using output_encoding::binary.
+  /// Strings are written once as a definition and referred to by id afterwards.
+  class binary_encoder {
+    public:
+      /// Appends the records of an entry to out, preceded by the header on
+      /// first use. If deferred is portable, its format string and arguments
+      /// are written instead of the message of info.
+      void encode(std::string& out, const entry_info& info, std::string_view fields,
+                  const deferred_message* deferred);
+
+
+
+    private:
+      struct string_hash {
+        using is_transparent = void;
+
+        [[nodiscard]] size_t operator()(std::string_view text) const noexcept {
+          return std::hash<std::string_view>{}(text);
+        }
+      };
+
+      bool started{false};
+      std::unordered_map<std::string, uint64_t, string_hash, std::equal_to<>> ids;
+
+      [[nodiscard]] uint64_t intern(std::string& out, std::string_view text);
+  };
+
+  /// Checks if a sink using output_encoding::binary is attached.
+  [[nodiscard]] bool binary_output() noexcept;
+
+
+
+  /// Checks if statistics are collected (see stats.hpp).
+  [[nodiscard]] bool collecting() noexcept;
+
+  /// Recomputes observing_filtered after the flight recorder or collecting
+  /// statistics have been started or stopped.
+  void update_observing_filtered() noexcept;
+
+  // The following functions only count if statistics are collected.
+  void count_entry(severity level) noexcept;
+  void count_merged() noexcept;
+  void count_bytes(size_t bytes) noexcept;
+
+
+
+  /// Checks if a mapped log is active (see mapped_log.hpp).
+  [[nodiscard]] bool mapping() noexcept;
+
+  /// Appends text to the active mapped log without taking output_mutex.
+  /// Returns true if the entry must not be written to the sinks as well.
+  [[nodiscard]] bool append_mapped(std::string_view text);
+
+
+
+  /// Writes an entry to the flight recorder if it is active.
+  void record_flight(severity level, std::chrono::microseconds time,
+                     std::string_view thread_name, std::string_view message) noexcept;
+
+
+
+  /// Checks if text matches pattern, where '*' matches any sequence of
+  /// characters and '?' any single character.
+  [[nodiscard]] bool glob_match(std::string_view pattern, std::string_view text);
+
+  /// Recomputes if call sites are enabled after output_level has changed.
+  void update_call_sites();
+
+  /// Updates the output_level of categories which follow the global one.
+  void update_categories();
+
+
+
+  /// Hands rec over to the background writer, leaving a previously written
+  /// record in rec whose buffers can be reused.
+  /// Returns false and leaves rec untouched if asynchronous output is disabled.
+  /// On the writer thread, rec is printed after the record currently written.
+  [[nodiscard]] bool enqueue(record& rec);
+
+  /// Blocks until all records queued prior to this call have been written.
+  /// Returns immediately on the writer thread.
+  void flush_writer();
+
+  /// Checks whether the calling thread is the background writer, which holds
+  /// output_mutex while running formatters and sinks.
+  [[nodiscard]] bool writer_thread() noexcept;
+
+  /// Stops the background writer after all queued records have been written.
+  void stop_writer();
+}
+
+#endif // LOGCERR_SRC_OUTPUT_HPP_INCLUDED
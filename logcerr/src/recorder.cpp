@@ -0,0 +1,561 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/flight_recorder.hpp"
+#include "logcerr/log.hpp"
+#include "src/output.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+
+
+namespace {
+  constexpr std::array<char, 8> file_magic{'L', 'O', 'G', 'C', 'F', 'R', '1', '\0'};
+  constexpr uint32_t            file_version{1};
+
+  struct file_header {
+    std::array<char, 8>     magic;
+    uint32_t                version;
+    uint32_t                slot_size;
+    uint64_t                slot_count;
+    // number of entries claimed so far, accessed through std::atomic_ref
+    uint64_t                next;
+    std::array<uint64_t, 4> reserved;
+  };
+
+  struct slot_header {
+    // 2 * n + 1 while entry n is written, 2 * n + 2 once it is complete,
+    // accessed through std::atomic_ref
+    uint64_t sequence;
+    int64_t  time;
+    uint32_t message_length;
+    uint8_t  level;
+    uint8_t  thread_length;
+    uint16_t reserved;
+  };
+
+  static_assert(sizeof(file_header) == 64);
+  static_assert(sizeof(slot_header) == 24);
+
+  constexpr size_t slot_alignment{8};
+
+
+
+
+
+  // A ring of fixed-size slots following a file_header. Entries are claimed by
+  // incrementing the header's counter and committed by publishing their
+  // sequence number in the slot, so that writers never wait for each other.
+  class ring {
+    public:
+      explicit ring(std::byte* base) : base{base} {}
+
+
+
+      // Allocates the buffer used by dump to copy slots, so that dumping does
+      // not allocate.
+      void reserve_dump_buffer() {
+        dump_buffer = std::make_unique<uint64_t[]>(header().slot_size / sizeof(uint64_t));
+      }
+
+      // Invokes callback like for_each using the buffer of reserve_dump_buffer.
+      // Returns false without invoking callback if another dump is in progress.
+      template<typename Callback>
+      bool dump(Callback&& callback) const {
+        if (dumping.exchange(true, std::memory_order_acquire)) {
+          return false;
+        }
+
+        //NOLINTNEXTLINE(*-reinterpret-cast)
+        for_each(reinterpret_cast<std::byte*>(dump_buffer.get()),
+                 std::forward<Callback>(callback));
+
+        dumping.store(false, std::memory_order_release);
+        return true;
+      }
+
+
+
+      [[nodiscard]] file_header& header() const {
+        return *reinterpret_cast<file_header*>(base); // NOLINT(*-reinterpret-cast)
+      }
+
+      [[nodiscard]] size_t capacity() const {
+        return header().slot_size - sizeof(slot_header);
+      }
+
+
+
+      void write(
+          logcerr::severity         level,
+          std::chrono::microseconds time,
+          std::string_view          thread_name,
+          std::string_view          message
+      ) noexcept {
+        const uint64_t claim{std::atomic_ref<uint64_t>{header().next}
+                               .fetch_add(1, std::memory_order_relaxed)};
+
+        auto& slot = slot_at(claim);
+        std::atomic_ref<uint64_t> sequence{slot.sequence};
+
+        sequence.store(2 * claim + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        thread_name = thread_name.substr(0, std::min<size_t>(capacity(), UINT8_MAX));
+        message     = message.substr(0, capacity() - thread_name.size());
+
+        slot.time           = time.count();
+        slot.level          = static_cast<uint8_t>(level);
+        slot.thread_length  = static_cast<uint8_t>(thread_name.size());
+        slot.message_length = static_cast<uint32_t>(message.size());
+
+        auto* payload = payload_of(slot);
+        std::memcpy(payload, thread_name.data(), thread_name.size());
+        std::memcpy(payload + thread_name.size(), message.data(), message.size());
+
+        sequence.store(2 * claim + 2, std::memory_order_release);
+      }
+
+
+
+      // Invokes callback(sequence, slot, thread_name, message) for every
+      // complete entry from oldest to newest. Every slot is copied to scratch,
+      // which must hold slot_size bytes aligned like a slot_header, and skipped
+      // if it has been overwritten meanwhile. Does not allocate.
+      template<typename Callback>
+      void for_each(std::byte* scratch, Callback&& callback) const {
+        const uint64_t next{std::atomic_ref<uint64_t>{header().next}
+                              .load(std::memory_order_acquire)};
+        const uint64_t count{header().slot_count};
+
+        for (uint64_t s = next > count ? next - count : 0; s < next; ++s) {
+          auto& slot = slot_at(s);
+          std::atomic_ref<uint64_t> sequence{slot.sequence};
+
+          if (sequence.load(std::memory_order_acquire) != 2 * s + 2) {
+            continue;
+          }
+
+          std::memcpy(scratch, &slot, header().slot_size);
+
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if (sequence.load(std::memory_order_relaxed) != 2 * s + 2) {
+            continue;
+          }
+
+          const auto& copy = *reinterpret_cast<const slot_header*>(scratch); // NOLINT(*-reinterpret-cast)
+
+          const auto* payload = payload_of(copy);
+          const size_t thread_length{std::min<size_t>(copy.thread_length, capacity())};
+          const size_t message_length{std::min<size_t>(copy.message_length,
+                                                       capacity() - thread_length)};
+
+          callback(s, copy, std::string_view{payload, thread_length},
+                   std::string_view{payload + thread_length, message_length});
+        }
+      }
+
+
+
+    private:
+      std::byte* base;
+
+      std::unique_ptr<uint64_t[]> dump_buffer;
+      mutable std::atomic<bool>   dumping{false};
+
+      [[nodiscard]] slot_header& slot_at(uint64_t sequence) const {
+        const auto offset = sizeof(file_header)
+          + (sequence % header().slot_count) * header().slot_size;
+        //NOLINTNEXTLINE(*-reinterpret-cast)
+        return *reinterpret_cast<slot_header*>(base + offset);
+      }
+
+      [[nodiscard]] static char* payload_of(slot_header& slot) {
+        //NOLINTNEXTLINE(*-reinterpret-cast)
+        return reinterpret_cast<char*>(&slot + 1);
+      }
+
+      [[nodiscard]] static const char* payload_of(const slot_header& slot) {
+        //NOLINTNEXTLINE(*-reinterpret-cast)
+        return reinterpret_cast<const char*>(&slot + 1);
+      }
+  };
+
+
+
+  [[nodiscard]] bool valid_header(const file_header& header, size_t size) {
+    return header.magic == file_magic && header.version == file_version
+      && header.slot_size > sizeof(slot_header) && header.slot_size % slot_alignment == 0
+      && header.slot_count > 0
+      && (size - sizeof(file_header)) / header.slot_size >= header.slot_count;
+  }
+
+
+
+
+
+  // Collects output in a fixed buffer and writes it with write(2) only, so that
+  // it can be used from signal handlers.
+  class signal_safe_writer {
+    public:
+      explicit signal_safe_writer(int fd) : fd{fd} {}
+
+      signal_safe_writer(const signal_safe_writer&) = delete;
+      signal_safe_writer(signal_safe_writer&&)      = delete;
+      signal_safe_writer& operator=(const signal_safe_writer&) = delete;
+      signal_safe_writer& operator=(signal_safe_writer&&)      = delete;
+
+      ~signal_safe_writer() { flush(); }
+
+
+
+      void append(std::string_view text) {
+        while (!text.empty()) {
+          if (length == buffer.size()) {
+            flush();
+          }
+
+          const size_t count{std::min(text.size(), buffer.size() - length)};
+          std::memcpy(buffer.data() + length, text.data(), count);
+          length += count;
+          text.remove_prefix(count);
+        }
+      }
+
+
+
+      void append_number(uint64_t value, size_t width) {
+        std::array<char, 20> digits{};
+        size_t count{0};
+
+        do {
+          digits.at(digits.size() - ++count) = static_cast<char>('0' + value % 10);
+          value /= 10;
+        } while (value > 0 && count < digits.size());
+
+        for (size_t padding = count; padding < width; ++padding) {
+          append("0");
+        }
+        append({digits.data() + digits.size() - count, count});
+      }
+
+
+
+      void flush() {
+        std::string_view pending{buffer.data(), length};
+
+        while (!pending.empty()) {
+          auto count = ::write(fd, pending.data(), pending.size());
+          if (count < 0) {
+            if (errno == EINTR) {
+              continue;
+            }
+            break;
+          }
+          pending.remove_prefix(count);
+        }
+
+        length = 0;
+      }
+
+
+
+    private:
+      static constexpr size_t buffer_size{512};
+
+      int                            fd;
+      std::array<char, buffer_size>  buffer{};
+      size_t                         length{0};
+  };
+
+
+
+  void dump_entry(
+      signal_safe_writer& out,
+      const slot_header&  slot,
+      std::string_view    thread_name,
+      std::string_view    message
+  ) {
+    static constexpr uint64_t micros_per_second{1000000};
+
+    const auto micros = static_cast<uint64_t>(std::max<int64_t>(slot.time, 0));
+    const auto seconds = micros / micros_per_second;
+
+    out.append("[");
+    out.append_number(seconds / 3600, 2);
+    out.append(":");
+    out.append_number((seconds / 60) % 60, 2);
+    out.append(":");
+    out.append_number(seconds % 60, 2);
+    out.append(".");
+    out.append_number(micros % micros_per_second, 6);
+    out.append(" ");
+    out.append(thread_name);
+    out.append("] ");
+    out.append(logcerr::impl::severity_name(static_cast<logcerr::severity>(slot.level)));
+    out.append(": ");
+    out.append(message);
+    out.append("\n");
+  }
+
+
+
+
+
+  namespace global_state {
+    // rings are never unmapped, since other threads may still write to them
+    // after the recorder has been stopped or replaced
+    std::atomic<ring*> active{nullptr};
+
+    std::atomic<int>   crash_fd{STDERR_FILENO};
+    std::atomic<bool>  crash_dumped{false};
+
+    std::terminate_handler previous_terminate{nullptr};
+
+    constexpr std::array<int, 5> crash_signals{SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    std::array<struct sigaction, crash_signals.size()> previous_actions{};
+  }
+
+
+
+  void dump_once() {
+    if (!global_state::crash_dumped.exchange(true)) {
+      logcerr::dump_flight_recorder(global_state::crash_fd.load());
+    }
+  }
+
+  void on_terminate() {
+    dump_once();
+
+    if (global_state::previous_terminate != nullptr) {
+      global_state::previous_terminate();
+    }
+    std::abort();
+  }
+
+  void on_signal(int signal) {
+    dump_once();
+
+    const auto* it = std::ranges::find(global_state::crash_signals, signal);
+    if (it != global_state::crash_signals.end()) {
+      const auto index = static_cast<size_t>(it - global_state::crash_signals.begin());
+      sigaction(signal, &global_state::previous_actions.at(index), nullptr);
+    }
+
+    // the signal is blocked until this handler returns and then delivered to
+    // the previous handler, which terminates the process by default
+    std::raise(signal);
+  }
+
+
+
+  thread_local std::string record_buffer;
+  thread_local bool        record_buffer_reserved{false};
+}
+
+
+
+
+
+void logcerr::flight_recorder(
+    const std::filesystem::path& path,
+    const recorder_options&      options
+) {
+  const size_t slot_size{(options.slot_size + slot_alignment - 1)
+                           / slot_alignment * slot_alignment};
+
+  if (options.slots == 0 || slot_size <= sizeof(slot_header)) {
+    throw std::invalid_argument{"expected at least one slot with room for an entry"};
+  }
+
+  const size_t length{sizeof(file_header) + options.slots * slot_size};
+
+  //NOLINTNEXTLINE(*-vararg)
+  const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw std::system_error{errno, std::generic_category(),
+                            "cannot open " + path.string()};
+  }
+
+  if (ftruncate(fd, static_cast<off_t>(length)) != 0) {
+    auto error = errno;
+    close(fd);
+    throw std::system_error{error, std::generic_category(),
+                            "cannot resize " + path.string()};
+  }
+
+  void* mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  auto error = errno;
+  close(fd);
+
+  if (mapping == MAP_FAILED) { // NOLINT(*-cstyle-cast)
+    throw std::system_error{error, std::generic_category(),
+                            "cannot map " + path.string()};
+  }
+
+  auto* recorder = new ring{static_cast<std::byte*>(mapping)}; // NOLINT(*-owning-memory)
+
+  auto& header = recorder->header();
+  header.version    = file_version;
+  header.slot_size  = static_cast<uint32_t>(slot_size);
+  header.slot_count = options.slots;
+  header.magic      = file_magic;
+
+  recorder->reserve_dump_buffer();
+
+  global_state::active.store(recorder);
+  impl::update_observing_filtered();
+}
+
+
+
+bool logcerr::flight_recorder() noexcept {
+  return impl::recording();
+}
+
+
+
+void logcerr::stop_flight_recorder() noexcept {
+  global_state::active.store(nullptr);
+  impl::update_observing_filtered();
+}
+
+
+
+void logcerr::dump_flight_recorder(int fd) noexcept {
+  const auto* recorder = global_state::active.load();
+  if (recorder == nullptr) {
+    return;
+  }
+
+  signal_safe_writer out{fd};
+  static_cast<void>(recorder->dump([&](uint64_t /*sequence*/, const slot_header& slot,
+                                       std::string_view thread_name, std::string_view message) {
+    dump_entry(out, slot, thread_name, message);
+  }));
+}
+
+
+
+void logcerr::dump_flight_recorder_on_crash(int fd) {
+  global_state::crash_fd = fd;
+
+  if (auto previous = std::set_terminate(on_terminate); previous != on_terminate) {
+    global_state::previous_terminate = previous;
+  }
+
+  struct sigaction action{};
+  action.sa_handler = on_signal; // NOLINT(*-union-access)
+  action.sa_flags   = SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+
+  for (size_t i = 0; i < global_state::crash_signals.size(); ++i) {
+    struct sigaction previous{};
+    sigaction(global_state::crash_signals.at(i), &action, &previous);
+
+    // installing the handlers again must not chain them to themselves
+    if (previous.sa_handler != on_signal) { // NOLINT(*-union-access)
+      global_state::previous_actions.at(i) = previous;
+    }
+  }
+}
+
+
+
+std::vector<logcerr::recorded_entry> logcerr::read_flight_recorder(
+    const std::filesystem::path& path
+) {
+  std::ifstream input{path, std::ios::binary};
+  std::vector<char> content{std::istreambuf_iterator<char>{input},
+                            std::istreambuf_iterator<char>{}};
+
+  // copy into storage which is suitably aligned for the header and the slots
+  std::vector<uint64_t> storage((content.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+  std::memcpy(storage.data(), content.data(), content.size());
+
+  auto* base = reinterpret_cast<std::byte*>(storage.data()); // NOLINT(*-reinterpret-cast)
+
+  if (content.size() < sizeof(file_header)
+      || !valid_header(ring{base}.header(), content.size())) {
+    throw std::runtime_error{"not a flight recorder file: " + path.string()};
+  }
+
+  const ring recorded{base};
+
+  std::vector<uint64_t> scratch(recorded.header().slot_size / sizeof(uint64_t));
+  auto* copy = reinterpret_cast<std::byte*>(scratch.data()); // NOLINT(*-reinterpret-cast)
+
+  std::vector<recorded_entry> entries;
+  recorded.for_each(copy, [&](uint64_t sequence, const slot_header& slot,
+                              std::string_view thread_name, std::string_view message) {
+    entries.push_back(recorded_entry{
+      .sequence    = sequence,
+      .time        = std::chrono::microseconds{slot.time},
+      .level       = static_cast<severity>(slot.level),
+      .thread_name = std::string{thread_name},
+      .message     = std::string{message}
+    });
+  });
+
+  return entries;
+}
+
+
+
+
+
+bool logcerr::impl::recording() noexcept {
+  return global_state::active.load(std::memory_order_relaxed) != nullptr;
+}
+
+
+
+logcerr::impl::buffer_lease logcerr::impl::record_buffer() {
+  if (record_buffer_reserved) {
+    return {};
+  }
+
+  ::record_buffer.clear();
+  return {::record_buffer, record_buffer_reserved};
+}
+
+
+
+void logcerr::impl::record_flight(
+    severity                  level,
+    std::chrono::microseconds time,
+    std::string_view          thread_name,
+    std::string_view          message
+) noexcept {
+  if (auto* recorder = global_state::active.load(std::memory_order_acquire)) {
+    recorder->write(level, time, thread_name, message);
+  }
+}
+
+
+
+void logcerr::impl::record_flight(severity level, std::string_view message) noexcept {
+  try {
+    record_flight(level, timestamp(), *current_thread_name(), message);
+  } catch (...) {
+    // the thread name could not be obtained, the entry is lost
+  }
+}
@@ -0,0 +1,251 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/sink.hpp"
+#include "src/output.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+
+
+namespace {
+  [[nodiscard]] int open_file(const std::filesystem::path& path) {
+    //NOLINTNEXTLINE(*-vararg)
+    return open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  }
+
+
+
+  [[nodiscard]] size_t file_size(int fd) {
+    struct stat info{};
+    if (fstat(fd, &info) != 0) {
+      return 0;
+    }
+    return static_cast<size_t>(info.st_size);
+  }
+
+
+
+  // Checks if path no longer refers to the file opened as fd, i.e. if it has
+  // been rotated or removed by someone else.
+  [[nodiscard]] bool replaced(int fd, const std::filesystem::path& path) {
+    struct stat opened{};
+    struct stat named{};
+
+    return fstat(fd, &opened) != 0 || stat(path.c_str(), &named) != 0
+      || opened.st_ino != named.st_ino || opened.st_dev != named.st_dev;
+  }
+
+
+
+  [[nodiscard]] std::filesystem::path numbered(std::filesystem::path path, size_t index) {
+    path += "." + std::to_string(index);
+    return path;
+  }
+
+
+}
+
+
+
+
+
+void logcerr::impl::shift_files(const std::filesystem::path& path, size_t keep) {
+  std::error_code ignored;
+
+  if (keep == 0) {
+    std::filesystem::remove(path, ignored);
+    return;
+  }
+
+  for (size_t i = keep; i > 1; --i) {
+    std::filesystem::rename(numbered(path, i - 1), numbered(path, i), ignored);
+  }
+  std::filesystem::rename(path, numbered(path, 1), ignored);
+}
+
+
+
+
+
+namespace logcerr::impl {
+  // Rotates the file of a rotating_file_sink when requested by a write or
+  // when a periodic check finds that the rotation_policy demands it. The
+  // output lock is only taken to exchange the file descriptor.
+  class rotator {
+    public:
+      explicit rotator(rotating_file_sink& target) :
+        target{target},
+        thread{[this](const std::stop_token& token) { run(token); }}
+      {}
+
+
+
+      void request() {
+        {
+          const std::lock_guard<std::mutex> lock{sleep_mutex};
+          pending = true;
+        }
+        wakeup.notify_one();
+      }
+
+
+
+    private:
+      static constexpr std::chrono::seconds poll_interval{1};
+
+      rotating_file_sink& target;
+
+      std::mutex                  sleep_mutex;
+      std::condition_variable_any wakeup;
+      bool                        pending{false}; // guarded by sleep_mutex
+
+      std::jthread thread;
+
+
+
+      void run(const std::stop_token& token) {
+        std::unique_lock<std::mutex> sleep_lock{sleep_mutex};
+
+        while (true) {
+          wakeup.wait_for(sleep_lock, token, poll_interval, [&]() { return pending; });
+
+          if (token.stop_requested()) {
+            return;
+          }
+
+          const bool forced = std::exchange(pending, false);
+
+          sleep_lock.unlock();
+          if (forced || due()) {
+            rotate_now(forced);
+          }
+          sleep_lock.lock();
+        }
+      }
+
+
+
+      // target.fd and target.rotate_at are only modified by this thread, so
+      // they can be read without holding the output lock
+      [[nodiscard]] bool due() {
+        const auto& policy = target.policy;
+
+        if (policy.size > 0 && file_size(target.fd) >= policy.size) {
+          return true;
+        }
+
+        if (policy.interval.count() > 0 && timestamp() >= target.rotate_at) {
+          if (file_size(target.fd) > 0) {
+            return true;
+          }
+
+          // an empty file is kept, its interval starts over
+          const std::lock_guard<std::mutex> lock{output_mutex()};
+          target.rotate_at = timestamp() + policy.interval;
+        }
+
+        return replaced(target.fd, target.file);
+      }
+
+
+
+      void rotate_now(bool forced) {
+        const int current = target.fd;
+
+        // another process may have rotated the file while waiting for the lock,
+        // in which case it only has to be reopened
+        flock(current, LOCK_EX);
+        if (!replaced(current, target.file) && (forced || due())) {
+          shift_files(target.file, target.policy.keep);
+        }
+        const int next = open_file(target.file);
+        flock(current, LOCK_UN);
+
+        if (next < 0) {
+          // keep writing to the current file, the next check retries
+          return;
+        }
+
+        const size_t size = file_size(next);
+        {
+          const std::lock_guard<std::mutex> lock{output_mutex()};
+
+          target.fd        = next;
+          target.written   = size;
+          target.rotate_at = timestamp() + target.policy.interval;
+          target.requested = false;
+        }
+
+        close(current);
+      }
+  };
+}
+
+
+
+
+
+logcerr::rotating_file_sink::rotating_file_sink(
+    std::filesystem::path  path,
+    const rotation_policy& policy
+) :
+  file  {std::move(path)},
+  policy{policy},
+  fd    {open_file(file)}
+{
+  if (fd < 0) {
+    throw std::system_error{errno, std::generic_category(),
+                            "cannot open " + file.string()};
+  }
+
+  written   = file_size(fd);
+  rotate_at = impl::timestamp() + policy.interval;
+
+  worker = std::make_unique<impl::rotator>(*this);
+}
+
+
+
+logcerr::rotating_file_sink::~rotating_file_sink() {
+  worker.reset();
+  close(fd);
+}
+
+
+
+void logcerr::rotating_file_sink::write(const entry_info* info, std::string_view text) {
+  impl::write_fd(fd, text);
+  written += text.size();
+
+  if (requested) {
+    return;
+  }
+
+  if ((policy.size > 0 && written >= policy.size)
+      || (info != nullptr && policy.interval.count() > 0 && info->time >= rotate_at)) {
+    requested = true;
+    worker->request();
+  }
+}
+
+
+
+void logcerr::rotating_file_sink::rotate() {
+  worker->request();
+}
@@ -0,0 +1,268 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/log.hpp"
+#include "src/output.hpp"
+
+#include <bit>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LOGCERR_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+
+
+namespace {
+  constexpr char escape_char{'\x1b'};
+
+  // an escaped byte takes at most 4 bytes (\xHH)
+  constexpr size_t max_escape_length{4};
+
+
+
+  // Checks if c ends a line or, with controls set, has to be sanitized.
+  [[nodiscard]] bool special(unsigned char c, bool controls) {
+    return c == '\n' || (controls && (c < 0x20 || c == 0x7f) && c != '\t');
+  }
+
+
+
+  // Each finder returns the position of the first byte at or after pos which
+  // is special, or std::string_view::npos.
+  using finder = size_t(*)(std::string_view, size_t, bool);
+
+  [[nodiscard]] size_t find_scalar(std::string_view text, size_t pos, bool controls) {
+    for (; pos < text.size(); ++pos) {
+      if (special(static_cast<unsigned char>(text[pos]), controls)) {
+        return pos;
+      }
+    }
+    return std::string_view::npos;
+  }
+
+
+
+#ifdef LOGCERR_X86_SIMD
+  // Bytes up to 0x1f are found as max(c, 0x1f) == 0x1f, since SSE2 and AVX2 only
+  // provide signed comparisons.
+
+  [[nodiscard]] size_t find_sse2(std::string_view text, size_t pos, bool controls) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i limit   = _mm_set1_epi8(0x1f);
+    const __m128i del     = _mm_set1_epi8(0x7f);
+    const __m128i tab     = _mm_set1_epi8('\t');
+
+    for (; pos + sizeof(__m128i) <= text.size(); pos += sizeof(__m128i)) {
+      //NOLINTNEXTLINE(*-reinterpret-cast)
+      const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + pos));
+
+      __m128i hits{};
+      if (controls) {
+        hits = _mm_or_si128(
+            _mm_andnot_si128(_mm_cmpeq_epi8(chunk, tab),
+                             _mm_cmpeq_epi8(_mm_max_epu8(chunk, limit), limit)),
+            _mm_cmpeq_epi8(chunk, del));
+      } else {
+        hits = _mm_cmpeq_epi8(chunk, newline);
+      }
+
+      if (const auto mask = static_cast<unsigned>(_mm_movemask_epi8(hits)); mask != 0) {
+        return pos + std::countr_zero(mask);
+      }
+    }
+
+    return find_scalar(text, pos, controls);
+  }
+
+
+
+  [[gnu::target("avx2")]]
+  [[nodiscard]] size_t find_avx2(std::string_view text, size_t pos, bool controls) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i limit   = _mm256_set1_epi8(0x1f);
+    const __m256i del     = _mm256_set1_epi8(0x7f);
+    const __m256i tab     = _mm256_set1_epi8('\t');
+
+    for (; pos + sizeof(__m256i) <= text.size(); pos += sizeof(__m256i)) {
+      //NOLINTNEXTLINE(*-reinterpret-cast)
+      const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text.data() + pos));
+
+      __m256i hits{};
+      if (controls) {
+        hits = _mm256_or_si256(
+            _mm256_andnot_si256(_mm256_cmpeq_epi8(chunk, tab),
+                                _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, limit), limit)),
+            _mm256_cmpeq_epi8(chunk, del));
+      } else {
+        hits = _mm256_cmpeq_epi8(chunk, newline);
+      }
+
+      if (const auto mask = static_cast<unsigned>(_mm256_movemask_epi8(hits)); mask != 0) {
+        return pos + std::countr_zero(mask);
+      }
+    }
+
+    return find_sse2(text, pos, controls);
+  }
+#endif
+
+
+
+  [[nodiscard]] finder select_finder() {
+#ifdef LOGCERR_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return &find_avx2;
+    }
+    return &find_sse2;
+#else
+    return &find_scalar;
+#endif
+  }
+
+  const finder find_special{select_finder()};
+
+
+
+
+
+  // Appends the control character at pos as escape sequence and returns the
+  // position after it.
+  size_t escape_control(std::string& out, std::string_view text, size_t pos) {
+    static constexpr std::string_view digits{"0123456789abcdef"};
+
+    const auto c = static_cast<unsigned char>(text[pos]);
+
+    if (c == '\r') {
+      out.append("\\r");
+    } else {
+      out.append("\\x");
+      out.push_back(digits[c >> 4U]);
+      out.push_back(digits[c & 0xfU]);
+    }
+
+    return pos + 1;
+  }
+
+
+
+  [[nodiscard]] bool in_range(char c, char first, char last) {
+    return c >= first && c <= last;
+  }
+
+  // Returns the position after the control character at pos, including the
+  // rest of the escape sequence it starts. Line breaks always end a sequence.
+  [[nodiscard]] size_t skip_control(std::string_view text, size_t pos) {
+    if (text[pos] != escape_char || pos + 1 == text.size()) {
+      return pos + 1;
+    }
+
+    const char kind = text[pos + 1];
+    pos += 2;
+
+    if (kind == '[') {
+      // CSI: parameter and intermediate bytes followed by a final byte
+      while (pos < text.size() && in_range(text[pos], 0x20, 0x3f)) {
+        ++pos;
+      }
+      if (pos < text.size() && in_range(text[pos], 0x40, 0x7e)) {
+        ++pos;
+      }
+      return pos;
+    }
+
+    if (kind == ']') {
+      // OSC: terminated by BEL or ESC backslash
+      for (; pos < text.size() && text[pos] != '\n'; ++pos) {
+        if (text[pos] == '\a') {
+          return pos + 1;
+        }
+        if (text[pos] == escape_char && pos + 1 < text.size() && text[pos + 1] == '\\') {
+          return pos + 2;
+        }
+      }
+      return pos;
+    }
+
+    if (in_range(kind, 0x20, 0x7e)) {
+      return pos;
+    }
+
+    // kind is a control character itself
+    return pos - 1;
+  }
+}
+
+
+
+
+
+void logcerr::impl::split_lines(
+    std::vector<std::string_view>& lines,
+    std::string&                   storage,
+    std::string_view               text,
+    control_policy                 policy
+) {
+  lines.clear();
+
+  const bool controls{policy != control_policy::keep};
+
+  // lines refer to storage once a control character has been found, the
+  // capacity reserved up front keeps them valid
+  bool   copied{false};
+  size_t line_start{0};
+  size_t pos{0};
+
+  while (true) {
+    const size_t next{find_special(text, pos, controls)};
+    const size_t end {next == std::string_view::npos ? text.size() : next};
+
+    if (copied) {
+      storage.append(text.substr(pos, end - pos));
+    }
+
+    if (next == std::string_view::npos) {
+      break;
+    }
+
+    if (text[next] == '\n') {
+      if (copied) {
+        lines.emplace_back(std::string_view{storage}.substr(line_start));
+        line_start = storage.size();
+      } else {
+        lines.emplace_back(text.substr(line_start, next - line_start));
+        line_start = next + 1;
+      }
+
+      pos = next + 1;
+      continue;
+    }
+
+    if (!copied) {
+      storage.clear();
+      storage.reserve(max_escape_length * text.size());
+      storage.append(text.substr(line_start, next - line_start));
+
+      copied     = true;
+      line_start = 0;
+    }
+
+    pos = policy == control_policy::escape ? escape_control(storage, text, next)
+                                           : skip_control(text, next);
+  }
+
+  if (copied) {
+    lines.emplace_back(std::string_view{storage}.substr(line_start));
+  } else {
+    lines.emplace_back(text.substr(line_start));
+  }
+
+  while (lines.size() > 1 && lines.back().empty()) {
+    lines.pop_back();
+  }
+}
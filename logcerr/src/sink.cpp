@@ -0,0 +1,935 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/log.hpp"
+#include "logcerr/sink.hpp"
+#include "src/output.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+
+
+namespace {
+  using clock = std::chrono::steady_clock;
+
+
+
+  [[nodiscard]] bool expired(
+      const logcerr::buffer_policy& policy,
+      const std::string&            buffer,
+      clock::time_point             pending_since,
+      clock::time_point             now
+  ) {
+    return policy.interval.count() > 0 && !buffer.empty()
+      && now - pending_since >= policy.interval;
+  }
+
+
+
+  [[nodiscard]] bool is_socket(int fd) {
+    struct stat info{};
+    return fstat(fd, &info) == 0 && S_ISSOCK(info.st_mode);
+  }
+
+
+
+  // Writes a prefix of data without blocking. Returns the number of bytes
+  // written, or -1 if fd does not accept data at the moment. Data which cannot
+  // be written due to any other error is discarded, like with write_fd.
+  [[nodiscard]] ssize_t write_some(int fd, bool socket, std::string_view data) {
+    while (true) {
+      auto count = socket ? ::send(fd, data.data(), data.size(), MSG_NOSIGNAL)
+                          : ::write(fd, data.data(), data.size());
+
+      if (count >= 0) {
+        return count;
+      }
+
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return -1;
+      }
+
+      return static_cast<ssize_t>(data.size());
+    }
+  }
+
+
+
+  void wait_writable(int fd, int timeout_ms) {
+    pollfd request{.fd = fd, .events = POLLOUT, .revents = 0};
+    static_cast<void>(poll(&request, 1, timeout_ms));
+  }
+
+
+
+  // Sets or clears O_NONBLOCK, returning the previous state.
+  bool set_nonblocking(int fd, bool enable) {
+    //NOLINTNEXTLINE(*-vararg)
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+      throw std::system_error{errno, std::generic_category(), "cannot get file status"};
+    }
+
+    const bool previous = (flags & O_NONBLOCK) != 0;
+    const int  updated  = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+
+    //NOLINTNEXTLINE(*-vararg)
+    if (updated != flags && fcntl(fd, F_SETFL, updated) < 0) {
+      throw std::system_error{errno, std::generic_category(), "cannot set file status"};
+    }
+
+    return previous;
+  }
+}
+
+
+
+
+
+namespace logcerr::impl {
+  // Writes buffered data which has been pending for longer than the configured
+  // interval, even if no further entries arrive.
+  class flusher {
+    public:
+      flusher(fd_sink& target, std::chrono::milliseconds interval) :
+        thread{[this, &target, interval](const std::stop_token& token) {
+          run(token, target, interval);
+        }}
+      {}
+
+
+
+    private:
+      std::mutex                  sleep_mutex;
+      std::condition_variable_any wakeup;
+
+      std::jthread thread;
+
+
+
+      void run(const std::stop_token& token, fd_sink& target,
+               std::chrono::milliseconds interval) {
+        std::unique_lock<std::mutex> sleep_lock{sleep_mutex};
+
+        while (!wakeup.wait_for(sleep_lock, token, interval, [&]() {
+                                  return token.stop_requested(); })) {
+          const std::lock_guard<std::mutex> lock{output_mutex()};
+
+          if (expired(target.policy, target.buffer, target.pending_since, clock::now())) {
+            target.flush();
+          }
+        }
+      }
+  };
+
+
+
+  // Output of a non-blocking fd_sink which could not be written yet. All
+  // members except the background thread are guarded by output_mutex.
+  class backlog {
+    public:
+      backlog(const backlog&) = delete;
+      backlog(backlog&&)      = delete;
+      backlog& operator=(const backlog&) = delete;
+      backlog& operator=(backlog&&)      = delete;
+
+      backlog(int fd, bool socket, const backlog_policy& policy) :
+        fd{fd}, socket{socket}, settings{policy},
+        was_nonblocking{set_nonblocking(fd, true)},
+        thread{[this]() { run(); }}
+      {}
+
+      ~backlog() {
+        stop();
+      }
+
+
+
+      [[nodiscard]] const backlog_policy& policy() const { return settings; }
+
+
+
+      // Writes data after all pending output, keeping what cannot be written
+      // without blocking.
+      void write(std::string_view data, severity level) {
+        bool idle{drain()};
+
+        if (idle && report_dropped()) {
+          // entries have been dropped while nothing was pending, e.g. since
+          // they exceeded the capacity
+          idle = drain();
+          if (!idle) {
+            wake();
+          }
+        }
+
+        if (idle) {
+          const size_t written{write_direct(data)};
+
+          if (written == data.size()) {
+            return;
+          }
+
+          if (written > 0) {
+            // the rest of a partially written entry is kept regardless of
+            // the capacity, since its line could not be completed otherwise
+            push(data.substr(written), level);
+            return;
+          }
+        }
+
+        if (settings.overload == overload_policy::block) {
+          write_blocking(data, level);
+          return;
+        }
+
+        if (admit(data.size(), level)) {
+          push(data, level);
+        } else {
+          ++dropped.at(static_cast<size_t>(level));
+        }
+      }
+
+
+
+      // Writes pending output without blocking. Returns true if nothing is
+      // pending anymore.
+      bool drain() {
+        while (!chunks.empty()) {
+          auto& front = chunks.front();
+          std::string_view rest{front.text};
+          rest.remove_prefix(written_front);
+
+          auto count = write_some(fd, socket, rest);
+          if (count < 0) {
+            return false;
+          }
+
+          mark_written(rest.substr(0, count));
+          written_front += count;
+
+          if (written_front == front.text.size()) {
+            pending_size -= front.text.size();
+            written_front = 0;
+            chunks.pop_front();
+
+            if (chunks.empty()) {
+              static_cast<void>(report_dropped());
+            }
+          }
+        }
+
+        return true;
+      }
+
+
+
+      // Blocks until all pending output has been written and restores the
+      // previous mode of the descriptor. Stops the background thread without
+      // waiting for it, which is done by the destructor.
+      void finish() {
+        stop_requested.store(true);
+        wake();
+
+        const auto deadline = std::chrono::steady_clock::now() + settings.drain_timeout;
+
+        while (!drain()) {
+          const auto left = std::chrono::ceil<std::chrono::milliseconds>(
+              deadline - std::chrono::steady_clock::now());
+
+          if (left.count() <= 0) {
+            // the reader is stalled, shutting down must not wait for it
+            discard();
+            static_cast<void>(drain());
+            break;
+          }
+
+          wait_writable(fd, static_cast<int>(std::min<int64_t>(left.count(), INT_MAX)));
+        }
+
+        if (!was_nonblocking) {
+          try {
+            set_nonblocking(fd, false);
+          } catch (...) {
+            // the descriptor may have been closed already
+          }
+        }
+      }
+
+
+
+    private:
+      struct chunk {
+        severity    level;
+        std::string text;
+      };
+
+      static constexpr size_t severity_count{5};
+      static constexpr int    poll_interval_ms{100};
+
+      int            fd;
+      bool           socket;
+      backlog_policy settings;
+      bool           was_nonblocking;
+
+      std::deque<chunk> chunks;
+      size_t            pending_size {0};
+      size_t            written_front{0};
+      bool              line_open    {false};
+
+      std::array<size_t, severity_count> dropped{};
+
+      std::atomic<bool> waiting       {false};
+      std::atomic<bool> stop_requested{false};
+
+      std::jthread      thread;
+
+
+
+      void stop() {
+        stop_requested.store(true);
+        wake();
+
+        if (thread.joinable()) {
+          thread.join();
+        }
+      }
+
+
+
+      void wake() {
+        waiting.store(true);
+        waiting.notify_one();
+      }
+
+
+
+      void run() {
+        while (true) {
+          waiting.wait(false);
+
+          if (stop_requested.load()) {
+            return;
+          }
+
+          wait_writable(fd, poll_interval_ms);
+
+          const std::lock_guard<std::mutex> lock{output_mutex()};
+
+          if (stop_requested.load()) {
+            return;
+          }
+
+          if (drain()) {
+            waiting.store(false);
+          }
+        }
+      }
+
+
+
+      [[nodiscard]] size_t write_direct(std::string_view data) {
+        size_t written{0};
+        while (written < data.size()) {
+          auto count = write_some(fd, socket, data.substr(written));
+          if (count < 0) {
+            break;
+          }
+
+          mark_written(data.substr(written, count));
+          written += count;
+        }
+
+        return written;
+      }
+
+
+
+      void mark_written(std::string_view data) {
+        if (!data.empty()) {
+          line_open = data.back() != '\n';
+        }
+      }
+
+
+
+      void push(std::string_view data, severity level) {
+        chunks.emplace_back(level, std::string{data});
+        pending_size += data.size();
+
+        wake();
+      }
+
+
+
+      [[nodiscard]] bool fits(size_t size) const {
+        return size <= settings.capacity && pending_size <= settings.capacity - size;
+      }
+
+
+
+      // Waits until data fits into the backlog. Entries larger than the
+      // capacity are written directly once nothing else is pending.
+      void write_blocking(std::string_view data, severity level) {
+        while (!fits(data.size()) && !drain()) {
+          wait_writable(fd, -1);
+        }
+
+        if (fits(data.size())) {
+          push(data, level);
+          return;
+        }
+
+        while (true) {
+          data.remove_prefix(write_direct(data));
+          if (data.empty()) {
+            return;
+          }
+          wait_writable(fd, -1);
+        }
+      }
+
+
+
+      // Makes room for size bytes according to a dropping overload_policy.
+      [[nodiscard]] bool admit(size_t size, severity level) {
+        if (fits(size)) {
+          return true;
+        }
+
+        switch (settings.overload) {
+          case overload_policy::drop_lowest:
+            return evict_below(level, size);
+
+          case overload_policy::errors_only:
+            return level >= severity::error && evict_below(level, size);
+
+          default:
+            return false;
+        }
+      }
+
+
+
+      // Discards pending entries below level, lowest severity and oldest
+      // first, until size bytes fit. A partially written entry is kept.
+      [[nodiscard]] bool evict_below(severity level, size_t size) {
+        for (size_t lowest = 0; lowest < static_cast<size_t>(level); ++lowest) {
+          auto it = chunks.begin();
+          if (written_front > 0 && it != chunks.end()) {
+            ++it;
+          }
+
+          while (it != chunks.end()) {
+            if (static_cast<size_t>(it->level) != lowest) {
+              ++it;
+              continue;
+            }
+
+            pending_size -= it->text.size();
+            ++dropped.at(lowest);
+            it = chunks.erase(it);
+
+            if (fits(size)) {
+              return true;
+            }
+          }
+        }
+
+        return fits(size);
+      }
+
+
+
+      // Queues a line counting the discarded entries per severity, once the
+      // output has caught up.
+      // Drops all pending entries, including a partially written one, and
+      // queues a line reporting them.
+      void discard() {
+        for (const auto& pending: chunks) {
+          ++dropped.at(static_cast<size_t>(pending.level));
+        }
+
+        chunks.clear();
+        pending_size  = 0;
+        written_front = 0;
+
+        static_cast<void>(report_dropped());
+      }
+
+
+
+      // Queues a line reporting the dropped entries. Returns false if none
+      // have been dropped.
+      bool report_dropped() {
+        size_t total{0};
+        for (auto count: dropped) {
+          total += count;
+        }
+
+        if (total == 0) {
+          return false;
+        }
+
+        std::string text{line_open ? "\n" : ""};
+        text.append(logcerr::format("[logcerr] dropped {} {} while the output was blocked:",
+                                    total, total == 1 ? "entry" : "entries"));
+
+        for (size_t level = severity_count; level-- > 0;) {
+          if (dropped.at(level) > 0) {
+            text.append(logcerr::format(" {} {},", dropped.at(level),
+                                        severity_name(static_cast<severity>(level))));
+          }
+        }
+        text.back() = '\n';
+
+        dropped = {};
+
+        chunks.emplace_back(severity::error, std::move(text));
+        pending_size += chunks.back().text.size();
+
+        return true;
+      }
+  };
+}
+
+
+
+
+
+logcerr::fd_sink::fd_sink(int fd, bool owned) :
+  fd    {fd},
+  owned {owned},
+  socket{is_socket(fd)}
+{}
+
+
+
+logcerr::fd_sink::~fd_sink() {
+  {
+    const std::lock_guard<std::mutex> lock{flusher_mutex};
+    timer.reset();
+  }
+
+  {
+    // the threads draining the backlog and reaping completions access them
+    // while holding the lock; they are joined by the member destructors
+    const std::lock_guard<std::mutex> lock{impl::output_mutex()};
+
+    write_unbuffered(buffer, buffer_level);
+
+    if (submissions) {
+      submissions->finish();
+    }
+
+    if (pending) {
+      pending->finish();
+    }
+  }
+
+  if (owned) {
+    close(fd);
+  }
+}
+
+
+
+void logcerr::impl::write_fd(int fd, std::string_view data) {
+  while (!data.empty()) {
+    auto count = ::write(fd, data.data(), data.size());
+
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    data.remove_prefix(count);
+  }
+}
+
+
+
+void logcerr::fd_sink::write_unbuffered(std::string_view data, severity level) {
+  if (pending) {
+    pending->write(data, level);
+    return;
+  }
+
+  if (submissions) {
+    submissions->write(data);
+    return;
+  }
+
+  if (!socket) {
+    impl::write_fd(fd, data);
+    return;
+  }
+
+  while (!data.empty()) {
+    auto count = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    data.remove_prefix(count);
+  }
+}
+
+
+
+void logcerr::fd_sink::write(const entry_info* info, std::string_view text) {
+  const auto level = info != nullptr ? info->level : severity::debug;
+
+  if (policy.size == 0) {
+    flush_buffer();
+    write_unbuffered(text, level);
+    return;
+  }
+
+  const bool timed = policy.interval.count() > 0;
+  const auto now   = timed ? clock::now() : clock::time_point{};
+
+  if (timed && buffer.empty()) {
+    pending_since = now;
+  }
+
+  if (buffer.empty() || level > buffer_level) {
+    buffer_level = level;
+  }
+  buffer.append(text);
+
+  if (buffer.size() >= policy.size || level >= policy.immediate
+      || (timed && expired(policy, buffer, pending_since, now))) {
+    flush_buffer();
+  }
+}
+
+
+
+void logcerr::fd_sink::flush_buffer() {
+  if (!buffer.empty()) {
+    write_unbuffered(buffer, buffer_level);
+    buffer.clear();
+  }
+}
+
+
+
+void logcerr::fd_sink::flush() {
+  flush_buffer();
+
+  if (pending) {
+    static_cast<void>(pending->drain());
+  }
+
+  if (submissions) {
+    submissions->flush();
+  }
+}
+
+
+
+bool logcerr::fd_sink::terminal() const {
+  return isatty(fd) != 0;
+}
+
+
+
+void logcerr::fd_sink::buffering(const buffer_policy& value) {
+  {
+    const std::lock_guard<std::mutex> lock{impl::output_mutex()};
+
+    flush();
+    policy = value;
+  }
+
+  const std::lock_guard<std::mutex> lock{flusher_mutex};
+
+  // the old flusher has to be stopped without holding output_mutex, since it
+  // may be waiting for it
+  timer.reset();
+
+  if (value.size > 0 && value.interval.count() > 0) {
+    timer = std::make_unique<impl::flusher>(*this, value.interval);
+  }
+}
+
+
+
+logcerr::buffer_policy logcerr::fd_sink::buffering() const {
+  const std::lock_guard<std::mutex> lock{impl::output_mutex()};
+
+  return policy;
+}
+
+
+
+void logcerr::fd_sink::nonblocking(const backlog_policy& value) {
+  switch (value.overload) {
+    case overload_policy::block:
+    case overload_policy::drop_newest:
+    case overload_policy::drop_lowest:
+    case overload_policy::errors_only:
+      break;
+    default:
+      throw std::invalid_argument{"expected a valid overload policy"};
+  }
+
+  // destroyed after unlocking, since its thread may be waiting for the lock
+  std::unique_ptr<impl::backlog> previous;
+
+  const std::lock_guard<std::mutex> lock{impl::output_mutex()};
+
+  flush();
+
+  previous = std::move(pending);
+  if (previous) {
+    previous->finish();
+  }
+
+  if (value.capacity > 0) {
+    pending = std::make_unique<impl::backlog>(fd, socket, value);
+  }
+}
+
+
+
+logcerr::backlog_policy logcerr::fd_sink::nonblocking() const {
+  const std::lock_guard<std::mutex> lock{impl::output_mutex()};
+
+  if (pending) {
+    return pending->policy();
+  }
+  return {};
+}
+
+
+
+void logcerr::fd_sink::uring(const uring_policy& value) {
+  if (value.count > 0 && value.size == 0) {
+    throw std::invalid_argument{"expected a positive buffer size"};
+  }
+
+  // destroyed after unlocking, since its thread may be waiting for the lock
+  std::unique_ptr<impl::ring> previous;
+
+  const std::lock_guard<std::mutex> lock{impl::output_mutex()};
+
+  flush();
+
+  previous = std::move(submissions);
+  if (previous) {
+    previous->finish();
+  }
+
+  if (value.count > 0 && !socket) {
+    submissions = impl::ring::create(fd, value);
+  }
+}
+
+
+
+logcerr::uring_policy logcerr::fd_sink::uring() const {
+  const std::lock_guard<std::mutex> lock{impl::output_mutex()};
+
+  if (submissions) {
+    return submissions->policy();
+  }
+  return {};
+}
+
+
+
+
+
+std::shared_ptr<logcerr::fd_sink> logcerr::stderr_sink() {
+  // Never destroyed, so that entries written during static destruction are not
+  // lost.
+  static auto* instance = new std::shared_ptr<fd_sink>{ // NOLINT(*-owning-memory)
+    std::make_shared<fd_sink>(STDERR_FILENO, false)};
+
+  return *instance;
+}
+
+
+
+std::shared_ptr<logcerr::fd_sink> logcerr::file_sink(const std::filesystem::path& path) {
+  //NOLINTNEXTLINE(*-vararg)
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+  if (fd < 0) {
+    throw std::system_error{errno, std::generic_category(),
+                            "cannot open " + path.string()};
+  }
+
+  return std::make_shared<fd_sink>(fd, true);
+}
+
+
+
+std::shared_ptr<logcerr::fd_sink> logcerr::unix_socket_sink(
+    const std::filesystem::path& path,
+    bool                         datagram
+) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+
+  const auto& name = path.native();
+  if (name.size() >= sizeof(address.sun_path)) {
+    throw std::system_error{ENAMETOOLONG, std::generic_category(),
+                            "cannot connect to " + path.string()};
+  }
+  std::memcpy(&address.sun_path[0], name.data(), name.size());
+
+  int fd = ::socket(AF_UNIX, (datagram ? SOCK_DGRAM : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw std::system_error{errno, std::generic_category(), "cannot create socket"};
+  }
+
+  //NOLINTNEXTLINE(*-reinterpret-cast)
+  if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+    auto error = errno;
+    close(fd);
+    throw std::system_error{error, std::generic_category(),
+                            "cannot connect to " + path.string()};
+  }
+
+  return std::make_shared<fd_sink>(fd, true);
+}
+
+
+
+
+
+void logcerr::buffering(const buffer_policy& policy) {
+  stderr_sink()->buffering(policy);
+}
+
+
+
+logcerr::buffer_policy logcerr::buffering() {
+  return stderr_sink()->buffering();
+}
+
+
+
+void logcerr::nonblocking(const backlog_policy& policy) {
+  stderr_sink()->nonblocking(policy);
+}
+
+
+
+logcerr::backlog_policy logcerr::nonblocking() {
+  return stderr_sink()->nonblocking();
+}
+
+
+
+void logcerr::uring(const uring_policy& policy) {
+  stderr_sink()->uring(policy);
+}
+
+
+
+logcerr::uring_policy logcerr::uring() {
+  return stderr_sink()->uring();
+}
+
+
+
+
+
+logcerr::ring_sink::ring_sink(size_t capacity) :
+  capacity{capacity}
+{
+  if (capacity == 0) {
+    throw std::invalid_argument{"expected a capacity of at least 1"};
+  }
+}
+
+
+
+void logcerr::ring_sink::write(const entry_info* info, std::string_view text) {
+  if (info == nullptr) {
+    return;
+  }
+
+  std::string line;
+  line.reserve(text.size());
+  for (char c: text) {
+    if (c != '\r') {
+      line.push_back(c);
+    }
+  }
+
+  if (line.starts_with('\n')) {
+    line.erase(0, 1);
+  }
+  if (line.ends_with('\n')) {
+    line.pop_back();
+  }
+
+  const std::lock_guard<std::mutex> lock{mutex};
+
+  if (info->update && !lines.empty()) {
+    auto& last = lines.back();
+    auto  pos  = last.rfind('\n');
+    last.erase(pos == std::string::npos ? 0 : pos + 1);
+    last.append(line);
+    return;
+  }
+
+  if (lines.size() == capacity) {
+    lines.pop_front();
+  }
+  lines.emplace_back(std::move(line));
+}
+
+
+
+std::vector<std::string> logcerr::ring_sink::entries() const {
+  const std::lock_guard<std::mutex> lock{mutex};
+
+  return {lines.begin(), lines.end()};
+}
+
+
+
+void logcerr::ring_sink::clear() {
+  const std::lock_guard<std::mutex> lock{mutex};
+
+  lines.clear();
+}
@@ -0,0 +1,289 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/stats.hpp"
+#include "src/output.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <mutex>
+#include <new>
+
+
+
+
+
+namespace {
+  #ifdef __cpp_lib_hardware_interference_size
+  constexpr size_t cache_line{std::hardware_destructive_interference_size};
+  #else
+  constexpr size_t cache_line{64};
+  #endif
+
+  constexpr size_t severity_count{5};
+  constexpr size_t shard_count{16};
+
+  using counter = std::atomic<uint64_t>;
+
+
+
+  void add(counter& value, uint64_t amount) noexcept {
+    value.fetch_add(amount, std::memory_order_relaxed);
+  }
+
+
+
+  struct histogram_shard {
+    std::array<counter, logcerr::latency_histogram::bucket_count> buckets{};
+    counter                                                       total{0};
+    counter                                                       max  {0};
+
+
+
+    void sample(std::chrono::nanoseconds duration) noexcept {
+      const auto ns = static_cast<uint64_t>(std::max<int64_t>(duration.count(), 0));
+
+      const size_t bucket{std::min<size_t>(std::bit_width(ns), buckets.size() - 1)};
+      add(buckets.at(bucket), 1);
+      add(total, ns);
+
+      auto current = max.load(std::memory_order_relaxed);
+      while (ns > current
+             && !max.compare_exchange_weak(current, ns, std::memory_order_relaxed)) {}
+    }
+
+
+
+    void collect(logcerr::latency_histogram& out) const noexcept {
+      for (size_t i = 0; i < buckets.size(); ++i) {
+        const auto count = buckets.at(i).load(std::memory_order_relaxed);
+        out.buckets.at(i) += count;
+        out.count         += count;
+      }
+
+      out.total += std::chrono::nanoseconds{total.load(std::memory_order_relaxed)};
+      out.max    = std::max(out.max,
+                            std::chrono::nanoseconds{max.load(std::memory_order_relaxed)});
+    }
+
+
+
+    void reset() noexcept {
+      for (auto& bucket: buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+      total.store(0, std::memory_order_relaxed);
+      max.store(0, std::memory_order_relaxed);
+    }
+  };
+
+
+
+  // Counters of a subset of threads. Threads are assigned to shards round
+  // robin, so that threads rarely write to the same cache lines.
+  struct alignas(cache_line) shard {
+    std::array<counter, severity_count> entries{};
+    counter                             filtered{0};
+    counter                             merged  {0};
+    counter                             bytes   {0};
+    histogram_shard                     lock_wait;
+    histogram_shard                     lock_hold;
+
+
+
+    void reset() noexcept {
+      for (auto& entry: entries) {
+        entry.store(0, std::memory_order_relaxed);
+      }
+      filtered.store(0, std::memory_order_relaxed);
+      merged.store(0, std::memory_order_relaxed);
+      bytes.store(0, std::memory_order_relaxed);
+      lock_wait.reset();
+      lock_hold.reset();
+    }
+  };
+}
+
+
+
+
+
+namespace { namespace global_state {
+  std::atomic<bool>                 enabled{false};
+
+  // serializes updates of impl::observing_filtered
+  std::mutex                        observing_mutex;
+
+  std::array<shard, shard_count>    shards;
+  std::atomic<size_t>               next_shard{0};
+}}
+
+
+
+
+
+namespace {
+  [[nodiscard]] shard& local_shard() noexcept {
+    thread_local shard& assigned = global_state::shards.at(
+        global_state::next_shard.fetch_add(1, std::memory_order_relaxed) % shard_count);
+
+    return assigned;
+  }
+}
+
+
+
+
+
+void logcerr::collect_stats(bool enable) noexcept {
+  global_state::enabled = enable;
+  impl::update_observing_filtered();
+}
+
+
+
+bool logcerr::collect_stats() noexcept {
+  return global_state::enabled;
+}
+
+
+
+logcerr::statistics logcerr::stats() {
+  statistics result;
+
+  for (const auto& current: global_state::shards) {
+    for (size_t i = 0; i < severity_count; ++i) {
+      result.entries.at(i) += current.entries.at(i).load(std::memory_order_relaxed);
+    }
+
+    result.filtered += current.filtered.load(std::memory_order_relaxed);
+    result.merged   += current.merged.load(std::memory_order_relaxed);
+    result.bytes    += current.bytes.load(std::memory_order_relaxed);
+
+    current.lock_wait.collect(result.lock_wait);
+    current.lock_hold.collect(result.lock_hold);
+  }
+
+  return result;
+}
+
+
+
+void logcerr::reset_stats() noexcept {
+  for (auto& current: global_state::shards) {
+    current.reset();
+  }
+}
+
+
+
+std::chrono::nanoseconds logcerr::latency_histogram::percentile(double p) const {
+  if (count == 0) {
+    return std::chrono::nanoseconds{0};
+  }
+
+  const auto target = static_cast<uint64_t>(
+      std::ceil(std::clamp(p, 0.0, 1.0) * static_cast<double>(count)));
+
+  uint64_t seen{0};
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    seen += buckets.at(i);
+
+    if (seen >= std::max<uint64_t>(target, 1)) {
+      if (i + 1 == buckets.size()) {
+        return max;
+      }
+      return std::min(max, std::chrono::nanoseconds{int64_t{1} << i});
+    }
+  }
+
+  return max;
+}
+
+
+
+
+
+void logcerr::impl::update_observing_filtered() noexcept {
+  const std::lock_guard<std::mutex> lock{global_state::observing_mutex};
+
+  observing_filtered.store(collecting() || recording(), std::memory_order_relaxed);
+}
+
+
+
+bool logcerr::impl::collecting() noexcept {
+  return global_state::enabled.load(std::memory_order_relaxed);
+}
+
+
+
+bool logcerr::impl::observe_filtered(severity /*level*/) noexcept {
+  if (collecting()) {
+    add(local_shard().filtered, 1);
+  }
+
+  return recording();
+}
+
+
+
+void logcerr::impl::count_entry(severity level) noexcept {
+  if (collecting()) {
+    add(local_shard().entries.at(static_cast<size_t>(level)), 1);
+  }
+}
+
+
+
+void logcerr::impl::count_merged() noexcept {
+  if (collecting()) {
+    add(local_shard().merged, 1);
+  }
+}
+
+
+
+void logcerr::impl::count_bytes(size_t bytes) noexcept {
+  if (collecting()) {
+    add(local_shard().bytes, bytes);
+  }
+}
+
+
+
+
+
+logcerr::impl::output_guard::output_guard() :
+  timed{collecting()}
+{
+  if (!timed) {
+    output_mutex().lock();
+    return;
+  }
+
+  if (output_mutex().try_lock()) {
+    // without contention, the time spent waiting is not worth a clock read
+    acquired = std::chrono::steady_clock::now();
+    local_shard().lock_wait.sample(std::chrono::nanoseconds{0});
+    return;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  output_mutex().lock();
+  acquired = std::chrono::steady_clock::now();
+
+  local_shard().lock_wait.sample(acquired - start);
+}
+
+
+
+logcerr::impl::output_guard::~output_guard() {
+  if (timed) {
+    local_shard().lock_hold.sample(std::chrono::steady_clock::now() - acquired);
+  }
+
+  output_mutex().unlock();
+}
@@ -0,0 +1,472 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#include "logcerr/log.hpp"
+#include "src/output.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define LOGCERR_URING
+#endif
+
+
+
+#ifdef LOGCERR_URING
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+
+
+namespace {
+  // user_data of the no-op submitted to wake the reaping thread
+  constexpr uint64_t wake_tag{~uint64_t{0}};
+
+  constexpr int retry_interval_ms{100};
+
+
+
+  [[nodiscard]] int uring_setup(unsigned entries, io_uring_params& params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  }
+
+  [[nodiscard]] int uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, complete, flags,
+                                    nullptr, 0));
+  }
+
+  [[nodiscard]] int uring_register(int fd, unsigned opcode, const void* args, unsigned count) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, args, count));
+  }
+
+
+
+  template<typename T>
+  [[nodiscard]] T* at(void* base, size_t offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset); // NOLINT(*-reinterpret-cast)
+  }
+
+
+
+  // The buffers of a ring are used as a queue: entries are copied into the
+  // last one until it is full or submitted. All buffers with data are
+  // submitted at once as a chain of linked writes, which the kernel performs
+  // in order. A chain is interrupted by a short write, in which case the rest
+  // is submitted again once all writes of the chain have completed.
+  class uring_ring : public logcerr::impl::ring {
+    public:
+      uring_ring(const uring_ring&) = delete;
+      uring_ring(uring_ring&&)      = delete;
+      uring_ring& operator=(const uring_ring&) = delete;
+      uring_ring& operator=(uring_ring&&)      = delete;
+
+      uring_ring(int fd, const logcerr::uring_policy& policy) :
+        fd{fd}, settings{policy}
+      {}
+
+      ~uring_ring() override {
+        stop_requested.store(true);
+        if (thread.joinable()) {
+          if (ring_fd >= 0) {
+            wake();
+          }
+          thread.join();
+        }
+
+        if (sqes != MAP_FAILED) {
+          munmap(sqes, sqes_size);
+        }
+        if (cq_map != MAP_FAILED && cq_map != sq_map) {
+          munmap(cq_map, cq_map_size);
+        }
+        if (sq_map != MAP_FAILED) {
+          munmap(sq_map, sq_map_size);
+        }
+        if (ring_fd >= 0) {
+          close(ring_fd);
+        }
+      }
+
+
+
+      // Returns false if io_uring is unavailable.
+      [[nodiscard]] bool setup() {
+        io_uring_params params{};
+
+        // one write per buffer and the no-op waking the thread
+        ring_fd = uring_setup(std::bit_ceil(static_cast<unsigned>(settings.count) + 1), params);
+        if (ring_fd < 0 || (params.features & IORING_FEAT_RW_CUR_POS) == 0) {
+          return false;
+        }
+
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqes_size   = params.sq_entries * sizeof(io_uring_sqe);
+
+        const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) {
+          sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+        }
+
+        sq_map = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQ_RING);
+        cq_map = single ? sq_map
+                        : mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes   = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQES);
+
+        if (sq_map == MAP_FAILED || cq_map == MAP_FAILED || sqes == MAP_FAILED) {
+          return false;
+        }
+
+        sq_tail  = at<unsigned>(sq_map, params.sq_off.tail);
+        sq_mask  = *at<unsigned>(sq_map, params.sq_off.ring_mask);
+        sq_array = at<unsigned>(sq_map, params.sq_off.array);
+        cq_head  = at<unsigned>(cq_map, params.cq_off.head);
+        cq_tail  = at<unsigned>(cq_map, params.cq_off.tail);
+        cq_mask  = *at<unsigned>(cq_map, params.cq_off.ring_mask);
+        cqes     = at<io_uring_cqe>(cq_map, params.cq_off.cqes);
+
+        storage = std::make_unique_for_overwrite<char[]>(settings.count * settings.size);
+
+        std::vector<iovec> buffers(settings.count);
+        for (size_t i = 0; i < buffers.size(); ++i) {
+          buffers[i] = iovec{.iov_base = buffer(i), .iov_len = settings.size};
+        }
+
+        // without registration, e.g. due to RLIMIT_MEMLOCK, the kernel maps
+        // the buffers for every write
+        fixed = uring_register(ring_fd, IORING_REGISTER_BUFFERS, buffers.data(),
+                               static_cast<unsigned>(buffers.size())) == 0;
+
+        slots.resize(settings.count);
+        for (size_t i = settings.count; i-- > 0;) {
+          free_slots.push_back(i);
+        }
+
+        thread = std::thread{[this]() { run(); }};
+
+        return true;
+      }
+
+
+
+      [[nodiscard]] const logcerr::uring_policy& policy() const override { return settings; }
+
+
+
+      void write(std::string_view data) override {
+        reap();
+
+        while (!data.empty()) {
+          if (!filling) {
+            while (free_slots.empty()) {
+              submit();
+              if (in_flight > 0) {
+                wait();
+              }
+              reap();
+            }
+
+            order.push_back(free_slots.back());
+            free_slots.pop_back();
+            slots[order.back()] = slot{};
+            filling = true;
+          }
+
+          auto& current = slots[order.back()];
+          const size_t count{std::min(data.size(), settings.size - current.size)};
+
+          std::memcpy(buffer(order.back()) + current.size, data.data(), count);
+          current.size += count;
+          data.remove_prefix(count);
+
+          if (current.size == settings.size) {
+            filling = false;
+          }
+        }
+
+        submit();
+      }
+
+
+
+      void flush() override {
+        submit();
+
+        while (!order.empty()) {
+          if (in_flight > 0) {
+            wait();
+          }
+          reap();
+        }
+      }
+
+
+
+      void finish() override {
+        flush();
+
+        stop_requested.store(true);
+        wake();
+      }
+
+
+
+    private:
+      struct slot {
+        size_t size   {0};
+        size_t written{0};
+      };
+
+      int                   fd;
+      logcerr::uring_policy settings;
+
+      int           ring_fd{-1};
+      void*         sq_map{MAP_FAILED};
+      void*         cq_map{MAP_FAILED};
+      void*         sqes  {MAP_FAILED};
+      size_t        sq_map_size{0};
+      size_t        cq_map_size{0};
+      size_t        sqes_size  {0};
+
+      unsigned*     sq_tail {nullptr};
+      unsigned      sq_mask {0};
+      unsigned*     sq_array{nullptr};
+      unsigned*     cq_head {nullptr};
+      unsigned*     cq_tail {nullptr};
+      unsigned      cq_mask {0};
+      io_uring_cqe* cqes    {nullptr};
+
+      std::unique_ptr<char[]> storage;
+      bool                    fixed{false};
+
+      // guarded by output_mutex
+      std::vector<slot>   slots;
+      std::vector<size_t> free_slots;
+      // slots holding data in the order it has to be written
+      std::deque<size_t>  order;
+      // true if the last slot of order has not been submitted yet
+      bool                filling  {false};
+      size_t              in_flight{0};
+      bool                blocked  {false};
+
+      std::atomic<bool>   stop_requested{false};
+      std::thread         thread;
+
+
+
+      [[nodiscard]] char* buffer(size_t index) const {
+        return storage.get() + index * settings.size;
+      }
+
+
+
+      [[nodiscard]] io_uring_sqe& next_sqe(unsigned tail) const {
+        const unsigned index{tail & sq_mask};
+        sq_array[index] = index;
+
+        auto& sqe = static_cast<io_uring_sqe*>(sqes)[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        return sqe;
+      }
+
+
+
+      void wait() const {
+        static_cast<void>(uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS));
+      }
+
+
+
+      // Submits a no-op, whose completion wakes the reaping thread.
+      void wake() const {
+        const unsigned tail{*sq_tail};
+
+        auto& sqe = next_sqe(tail);
+        sqe.opcode    = IORING_OP_NOP;
+        sqe.user_data = wake_tag;
+
+        std::atomic_ref<unsigned>{*sq_tail}.store(tail + 1, std::memory_order_release);
+        static_cast<void>(uring_enter(ring_fd, 1, 0, 0));
+      }
+
+
+
+      // Submits all slots with pending data unless writes are in progress.
+      void submit() {
+        if (in_flight > 0 || order.empty()) {
+          return;
+        }
+
+        if (blocked) {
+          // the descriptor has been put into non-blocking mode by someone else
+          pollfd request{.fd = fd, .events = POLLOUT, .revents = 0};
+          static_cast<void>(poll(&request, 1, retry_interval_ms));
+          blocked = false;
+        }
+
+        filling = false;
+
+        const unsigned start{*sq_tail};
+        unsigned       tail {start};
+        for (size_t i = 0; i < order.size(); ++i) {
+          const auto& current = slots[order[i]];
+
+          auto& sqe = next_sqe(tail++);
+          sqe.opcode    = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+          sqe.fd        = fd;
+          sqe.off       = ~uint64_t{0};
+          sqe.addr      = reinterpret_cast<uint64_t>(buffer(order[i]) + current.written); // NOLINT(*-reinterpret-cast)
+          sqe.len       = static_cast<uint32_t>(current.size - current.written);
+          sqe.buf_index = static_cast<uint16_t>(order[i]);
+          sqe.user_data = order[i];
+          sqe.flags     = i + 1 < order.size() ? IOSQE_IO_LINK : 0;
+        }
+
+        std::atomic_ref<unsigned>{*sq_tail}.store(tail, std::memory_order_release);
+
+        int result{0};
+        do {
+          result = uring_enter(ring_fd, static_cast<unsigned>(order.size()), 0, 0);
+        } while (result < 0 && errno == EINTR);
+
+        in_flight = static_cast<size_t>(std::max(result, 0));
+
+        if (in_flight < order.size()) {
+          // entries the kernel has not consumed would be submitted again by
+          // the next call; slots which have not been submitted are submitted
+          // once the chain in progress has completed
+          std::atomic_ref<unsigned>{*sq_tail}.store(start + static_cast<unsigned>(in_flight),
+                                              std::memory_order_release);
+        }
+
+        if (in_flight == 0) {
+          write_directly();
+        }
+      }
+
+
+
+      // Writes everything pending with plain calls if submitting fails.
+      void write_directly() {
+        for (auto index: order) {
+          auto& current = slots[index];
+          logcerr::impl::write_fd(fd, {buffer(index) + current.written,
+                                       current.size - current.written});
+          current.written = current.size;
+        }
+
+        release();
+      }
+
+
+
+      // Frees the slots at the front of order which have been written
+      // completely, except for a slot which is still being filled.
+      void release() {
+        while (!order.empty() && !(filling && order.size() == 1)
+               && slots[order.front()].written == slots[order.front()].size) {
+          free_slots.push_back(order.front());
+          order.pop_front();
+        }
+      }
+
+
+
+      void reap() {
+        unsigned head{*cq_head};
+        const unsigned tail{std::atomic_ref<unsigned>{*cq_tail}.load(std::memory_order_acquire)};
+
+        for (; head != tail; ++head) {
+          const auto& cqe = cqes[head & cq_mask];
+          if (cqe.user_data == wake_tag) {
+            continue;
+          }
+
+          --in_flight;
+
+          auto& current = slots.at(cqe.user_data);
+          if (cqe.res > 0) {
+            current.written = std::min(current.size, current.written + cqe.res);
+          } else if (cqe.res == -EAGAIN) {
+            blocked = true;
+          } else if (cqe.res != -EINTR && cqe.res != -ECANCELED) {
+            // discarded like with write_fd
+            current.written = current.size;
+          }
+        }
+
+        std::atomic_ref<unsigned>{*cq_head}.store(head, std::memory_order_release);
+
+        release();
+
+        // writes collected while the previous chain was in progress
+        submit();
+      }
+
+
+
+      void run() {
+        while (!stop_requested.load()) {
+          wait();
+
+          const std::lock_guard<std::mutex> lock{logcerr::impl::output_mutex()};
+
+          if (stop_requested.load()) {
+            return;
+          }
+
+          reap();
+        }
+      }
+  };
+}
+
+
+
+
+
+std::unique_ptr<logcerr::impl::ring> logcerr::impl::ring::create(
+    int                 fd,
+    const uring_policy& policy
+) {
+  auto instance = std::make_unique<uring_ring>(fd, policy);
+
+  if (!instance->setup()) {
+    return {};
+  }
+
+  return instance;
+}
+
+
+
+#else
+
+
+
+std::unique_ptr<logcerr::impl::ring> logcerr::impl::ring::create(
+    int                 /*fd*/,
+    const uring_policy& /*policy*/
+) {
+  return {};
+}
+
+#endif
@@ -0,0 +1,71 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+#ifndef LOGCERR_TOOLS_ARGUMENTS_HPP_INCLUDED
+#define LOGCERR_TOOLS_ARGUMENTS_HPP_INCLUDED
+
+#include <logcerr/log.hpp>
+
+#include <charconv>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+
+
+// Parsers for command line arguments shared by the tools.
+namespace tools {
+  [[nodiscard]] inline logcerr::severity parse_level(std::string_view name) {
+    if (name == "debug")   { return logcerr::severity::debug;   }
+    if (name == "verbose") { return logcerr::severity::verbose; }
+    if (name == "log")     { return logcerr::severity::log;     }
+    if (name == "warning") { return logcerr::severity::warning; }
+    if (name == "error")   { return logcerr::severity::error;   }
+
+    throw std::invalid_argument{"unknown severity: " + std::string{name}};
+  }
+
+
+
+  [[nodiscard]] inline long parse_number(std::string_view text, std::string_view input) {
+    long value{0};
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+
+    if (error != std::errc{} || end != text.data() + text.size() || text.empty()) {
+      throw std::invalid_argument{"invalid time: " + std::string{input}};
+    }
+
+    return value;
+  }
+
+
+
+  /// Parses a time since start given as [[HH:]MM:]SS[.ffffff].
+  [[nodiscard]] inline std::chrono::microseconds parse_time(std::string_view input) {
+    static constexpr long micros_per_second{1000000};
+
+    auto text = input;
+    long fraction{0};
+
+    if (auto dot = text.find('.'); dot != std::string_view::npos) {
+      auto digits = text.substr(dot + 1, 6);
+      fraction = parse_number(digits, input);
+      for (size_t i = digits.size(); i < 6; ++i) {
+        fraction *= 10;
+      }
+      text = text.substr(0, dot);
+    }
+
+    long seconds{0};
+    while (!text.empty()) {
+      auto colon = text.find(':');
+      seconds = seconds * 60 + parse_number(text.substr(0, colon), input);
+      text.remove_prefix(colon == std::string_view::npos ? text.size() : colon + 1);
+    }
+
+    return std::chrono::microseconds{seconds * micros_per_second + fraction};
+  }
+}
+
+#endif // LOGCERR_TOOLS_ARGUMENTS_HPP_INCLUDED
@@ -0,0 +1,168 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+// Decodes logs written with logcerr::output_encoding::binary to the text
+// layout used for stderr. Entries are filtered by their metadata, so that
+// discarded entries are never formatted.
+
+#include "arguments.hpp"
+
+#include <logcerr/binary.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+
+namespace {
+  constexpr std::string_view usage{
+R"(usage: logcerr-cat [options] [file...]
+
+Decodes binary logcerr logs to text. Reads stdin if no file or "-" is given.
+
+options:
+  -l, --level LEVEL    only entries of at least LEVEL
+                       (debug, verbose, log, warning, error)
+  -t, --thread NAME    only entries of the thread NAME, may be repeated
+  -f, --from TIME      only entries created at or after TIME
+  -u, --until TIME     only entries created before TIME
+      --utc            show wall-clock time instead of the time since start
+      --micro          show timestamps with microseconds
+  -c, --color          use colors
+  -h, --help           show this help
+
+TIME is the time since start as [[HH:]MM:]SS[.ffffff].
+)"};
+
+
+
+  struct filter {
+    logcerr::severity                        level{logcerr::severity::debug};
+    std::vector<std::string>                 threads;
+    std::optional<std::chrono::microseconds> from;
+    std::optional<std::chrono::microseconds> until;
+
+    [[nodiscard]] bool accepts(const logcerr::binary_entry& entry) const {
+      return entry.level >= level
+        && (!from  || entry.time >= *from)
+        && (!until || entry.time < *until)
+        && (threads.empty() || std::ranges::find(threads, entry.thread_name) != threads.end());
+    }
+  };
+
+
+
+  struct settings {
+    filter                   selection;
+    logcerr::time_format     time{logcerr::time_format::elapsed};
+    bool                     utc{false};
+    bool                     micro{false};
+    bool                     colored{false};
+    std::vector<std::string> files;
+  };
+
+
+
+  [[nodiscard]] std::optional<settings> parse_arguments(int argc, char** argv) {
+    settings result;
+
+    const std::vector<std::string_view> args(argv + 1, argv + argc);
+
+    for (auto it = args.begin(); it != args.end(); ++it) {
+      auto value = [&]() {
+        if (++it == args.end()) {
+          throw std::invalid_argument{"missing value for " + std::string{*(it - 1)}};
+        }
+        return *it;
+      };
+
+      if (*it == "-h" || *it == "--help") {
+        std::cout << usage;
+        return {};
+      } else if (*it == "-l" || *it == "--level") {
+        result.selection.level = tools::parse_level(value());
+      } else if (*it == "-t" || *it == "--thread") {
+        result.selection.threads.emplace_back(value());
+      } else if (*it == "-f" || *it == "--from") {
+        result.selection.from = tools::parse_time(value());
+      } else if (*it == "-u" || *it == "--until") {
+        result.selection.until = tools::parse_time(value());
+      } else if (*it == "--utc") {
+        result.utc = true;
+      } else if (*it == "--micro") {
+        result.micro = true;
+      } else if (*it == "-c" || *it == "--color") {
+        result.colored = true;
+      } else if (it->starts_with('-') && *it != "-") {
+        throw std::invalid_argument{"unknown option: " + std::string{*it}};
+      } else {
+        result.files.emplace_back(*it);
+      }
+    }
+
+    if (result.utc) {
+      result.time = result.micro ? logcerr::time_format::utc_micro
+                                 : logcerr::time_format::utc;
+    } else if (result.micro) {
+      result.time = logcerr::time_format::elapsed_micro;
+    }
+
+    if (result.files.empty()) {
+      result.files.emplace_back("-");
+    }
+
+    return result;
+  }
+
+
+
+  void decode(std::istream& input, const settings& options) {
+    logcerr::binary_reader reader{input};
+    logcerr::binary_entry  entry;
+
+    while (reader.next(entry)) {
+      if (options.selection.accepts(entry)) {
+        std::cout << logcerr::format_text(entry, reader.start(), options.time,
+                                          options.colored);
+      }
+    }
+  }
+}
+
+
+
+
+
+int main(int argc, char** argv) {
+  try {
+    auto options = parse_arguments(argc, argv);
+    if (!options) {
+      return 0;
+    }
+
+    for (const auto& file: options->files) {
+      if (file == "-") {
+        decode(std::cin, *options);
+        continue;
+      }
+
+      std::ifstream input{file, std::ios::binary};
+      if (!input) {
+        throw std::runtime_error{"cannot open " + file};
+      }
+      decode(input, *options);
+    }
+  } catch (const std::exception& ex) {
+    std::cout.flush();
+    std::cerr << "logcerr-cat: " << ex.what() << '\n';
+    return 1;
+  }
+}
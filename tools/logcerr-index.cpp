@@ -0,0 +1,157 @@
+// Copyright (c) 2023 wolmibo
+// SPDX-License-Identifier: MIT
+
+// Uses the index written by logcerr::indexed_sink to print the entries of a
+// time range or to list where entries of a given severity are, reading only
+// the required parts of the log.
+
+#include "arguments.hpp"
+
+#include <logcerr/log_index.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+
+namespace {
+  constexpr std::string_view usage{
+R"(usage: logcerr-index [options] file
+
+Reads file.idx written by logcerr::indexed_sink next to file.
+
+options:
+  -f, --from TIME      print the entries created at or after TIME
+  -u, --until TIME     print the entries created before TIME
+  -l, --level LEVEL    list the blocks holding entries of at least LEVEL
+                       (debug, verbose, log, warning, error)
+  -h, --help           show this help
+
+Without options, all blocks are listed. TIME is the time since start as
+[[HH:]MM:]SS[.ffffff]. Time ranges are printed at block granularity.
+)"};
+
+
+
+  struct settings {
+    std::optional<std::chrono::microseconds> from;
+    std::optional<std::chrono::microseconds> until;
+    logcerr::severity                        level{logcerr::severity::debug};
+    std::string                              file;
+  };
+
+
+
+  [[nodiscard]] std::optional<settings> parse_arguments(int argc, char** argv) {
+    settings result;
+
+    const std::vector<std::string_view> args(argv + 1, argv + argc);
+
+    for (auto it = args.begin(); it != args.end(); ++it) {
+      auto value = [&]() {
+        if (++it == args.end()) {
+          throw std::invalid_argument{"missing value for " + std::string{*(it - 1)}};
+        }
+        return *it;
+      };
+
+      if (*it == "-h" || *it == "--help") {
+        std::cout << usage;
+        return {};
+      } else if (*it == "-f" || *it == "--from") {
+        result.from = tools::parse_time(value());
+      } else if (*it == "-u" || *it == "--until") {
+        result.until = tools::parse_time(value());
+      } else if (*it == "-l" || *it == "--level") {
+        result.level = tools::parse_level(value());
+      } else if (it->starts_with('-') || !result.file.empty()) {
+        throw std::invalid_argument{"unexpected argument: " + std::string{*it}};
+      } else {
+        result.file = *it;
+      }
+    }
+
+    if (result.file.empty()) {
+      throw std::invalid_argument{"expected a file"};
+    }
+
+    return result;
+  }
+
+
+
+  void list(const std::vector<logcerr::index_block>& blocks) {
+    static constexpr std::array<std::string_view, 5> names{
+      "debug", "verbose", "log", "warning", "error"
+    };
+
+    for (const auto& block: blocks) {
+      std::cout << block.begin << '-' << block.end << "  "
+                << block.earliest.count() << "us-" << block.latest.count() << "us ";
+
+      for (size_t i = 0; i < names.size(); ++i) {
+        if (block.entries.at(i) > 0) {
+          std::cout << ' ' << names.at(i) << '=' << block.entries.at(i);
+        }
+      }
+
+      std::cout << '\n';
+    }
+  }
+
+
+
+  void print(const std::string& file, logcerr::byte_range range) {
+    std::ifstream input{file, std::ios::binary};
+    if (!input) {
+      throw std::runtime_error{"cannot open " + file};
+    }
+
+    input.seekg(static_cast<std::streamoff>(range.begin));
+
+    std::array<char, 1U << 16U> buffer{};
+    for (uint64_t left = range.end - range.begin; left > 0 && input;) {
+      input.read(buffer.data(),
+                 static_cast<std::streamsize>(std::min<uint64_t>(left, buffer.size())));
+
+      const auto count = static_cast<uint64_t>(input.gcount());
+      std::cout.write(buffer.data(), static_cast<std::streamsize>(count));
+      left -= count;
+    }
+  }
+}
+
+
+
+
+
+int main(int argc, char** argv) {
+  try {
+    auto options = parse_arguments(argc, argv);
+    if (!options) {
+      return 0;
+    }
+
+    const logcerr::log_index index{options->file + ".idx"};
+
+    if (options->from || options->until) {
+      print(options->file, index.find(options->from.value_or(std::chrono::microseconds::min()),
+                                      options->until.value_or(std::chrono::microseconds::max())));
+    } else {
+      list(index.find(options->level));
+    }
+  } catch (const std::exception& ex) {
+    std::cout.flush();
+    std::cerr << "logcerr-index: " << ex.what() << '\n';
+    return 1;
+  }
+}